@@ -12,6 +12,10 @@
 
 #include "vikalloc.h"
 
+#ifdef VIK_THREADS
+# include <pthread.h>
+#endif // VIK_THREADS
+
 #ifndef NUM_PTRS
 # define NUM_PTRS 100
 #endif // NUM_PTRS
@@ -70,12 +74,24 @@ void freefree(int);
 void calloc1(int);
 void calloc2(int);
 void calloc3(int);
+void calloc4(int);
+void aligned1(int);
+void batch1(int);
+void sized1(int);
+void region1(int);
+void pool1(int);
+void stats1(int);
+void frag1(int);
+void dump1(int);
+void trace1(int);
 void realloc1(int);
 
 void realloc2(int);
 void realloc3(int);
 void realloc4(int);
 void realloc5(int);
+void realloc6(int);
+void realloc7(int);
 
 void stress1(int);
 void stress2(int);
@@ -85,6 +101,14 @@ void stress5(int);
 
 void strdup1(int);
 
+void small1(int);
+void mmap1(int);
+void trim1(int);
+void purge1(int);
+#ifdef VIK_THREADS
+void threads1(int);
+#endif // VIK_THREADS
+
 void bestfit1(int);
 void bestfit2(int);
 void bestfit3(int);
@@ -252,6 +276,26 @@ first_fit_tests(void)
 
     VIKTEST(29,strdup1);
 
+    VIKTEST(31,small1);
+#ifdef VIK_THREADS
+    VIKTEST(32,threads1);
+#endif // VIK_THREADS
+    VIKTEST(33,mmap1);
+    VIKTEST(34,trim1);
+    VIKTEST(35,purge1);
+    VIKTEST(36,realloc6);
+    VIKTEST(37,realloc7);
+    VIKTEST(38,calloc4);
+    VIKTEST(39,aligned1);
+    VIKTEST(40,batch1);
+    VIKTEST(41,sized1);
+    VIKTEST(42,region1);
+    VIKTEST(43,pool1);
+    VIKTEST(44,stats1);
+    VIKTEST(45,frag1);
+    VIKTEST(46,dump1);
+    VIKTEST(47,trace1);
+
     if (test_number == 0) {
         fprintf(log_stream, "\n\nWoooooooHooooooo!!! "
                 "All tests done and you survived. This only means it did not seg-fault.\n\n"
@@ -268,6 +312,9 @@ void
 best_fit_tests(void)
 {
     fprintf(log_stream, "vikalloc best fit tests starting\n");
+    // these tests check exactly where blocks land, which blocks held
+    //   in a thread cache would change.
+    vikalloc_set_thread_cache(FALSE);
 
     if (test_number == 0) {
         fprintf(log_stream, "  running all tests\n");
@@ -294,6 +341,9 @@ best_fit_tests(void)
     if (test_number == 0 || test_number == 6) {
         bestfit6(test_number);
     }    
+    if (test_number == 0 || test_number == 7) {
+        sized1(test_number);
+    }
 
     if (test_number == 0) {
         fprintf(log_stream, "\n\nWoooooooHooooooo!!! "
@@ -311,6 +361,9 @@ void
 worst_fit_tests(void)
 {
     fprintf(log_stream, "vikalloc worst fit tests starting\n");
+    // these tests check exactly where blocks land, which blocks held
+    //   in a thread cache would change.
+    vikalloc_set_thread_cache(FALSE);
 
     if (test_number == 0) {
         fprintf(log_stream, "  running all tests\n");
@@ -330,6 +383,9 @@ worst_fit_tests(void)
     if (test_number == 0 || test_number == 4) {
         bestfit4(test_number);
     }    
+    if (test_number == 0 || test_number == 5) {
+        sized1(test_number);
+    }
 
     if (test_number == 0) {
         fprintf(log_stream, "\n\nWoooooooHooooooo!!! "
@@ -398,6 +454,23 @@ next_fit_tests(void)
 
     VIKTEST(30,split1);
 
+    VIKTEST(31,small1);
+    VIKTEST(33,mmap1);
+    VIKTEST(34,trim1);
+    VIKTEST(35,purge1);
+    VIKTEST(36,realloc6);
+    VIKTEST(37,realloc7);
+    VIKTEST(38,calloc4);
+    VIKTEST(39,aligned1);
+    VIKTEST(40,batch1);
+    VIKTEST(41,sized1);
+    VIKTEST(42,region1);
+    VIKTEST(43,pool1);
+    VIKTEST(44,stats1);
+    VIKTEST(45,frag1);
+    VIKTEST(46,dump1);
+    VIKTEST(47,trace1);
+
     
     if (test_number == 0) {
         fprintf(log_stream, "\n\nWoooooooHooooooo!!! "
@@ -1626,6 +1699,117 @@ realloc5(int testno)
     fprintf(log_stream, "*** End %d\n", testno);
 }
 
+void
+realloc6(int testno)
+{
+    char *ptr1 = NULL;
+    char *ptr2 = NULL;
+    char *ptr3 = NULL;
+    char *old = NULL;
+    char *start = sbrk(0);
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikrealloc 6, in place\n");
+
+    ptr1 = vikalloc(1000);
+    ptr2 = vikalloc(1000);
+    ptr3 = vikalloc(1000);
+    memset(ptr1, 'a', 1000);
+    memset(ptr3, 'c', 1000);
+
+    // ptr1 takes in the free block after it
+    vikfree(ptr2);
+    old = ptr1;
+    ptr1 = vikrealloc(ptr1, 1800);
+    assert(ptr1 == old);
+    assert(ptr1[0] == 'a' && ptr1[999] == 'a');
+    memset(ptr1, 'a', 1800);
+    vikalloc_dump2((long) base);
+
+    // the end it no longer needs goes back to the heap
+    ptr1 = vikrealloc(ptr1, 200);
+    assert(ptr1 == old);
+    assert(ptr1[0] == 'a' && ptr1[199] == 'a');
+    ptr2 = vikalloc(1500);
+    assert(ptr2 > ptr1 && ptr2 < ptr3);
+    vikalloc_dump2((long) base);
+
+    // the block at the end of the heap grows with the heap
+    old = ptr3;
+    for (i = 1; i <= 50; i++) {
+        ptr3 = vikrealloc(ptr3, 1000 + i * 1000);
+        assert(ptr3 == old);
+        memset(ptr3 + (i - 1) * 1000 + 1000, 'c', 1000);
+    }
+    for (i = 0; i < 51000; i += 1000) {
+        assert(ptr3[i] == 'c');
+    }
+    assert(ptr1[199] == 'a');
+    vikalloc_dump2((long) base);
+
+    vikfree(ptr1);
+    vikfree(ptr2);
+    vikfree(ptr3);
+    vikalloc_dump2((long) base);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+realloc7(int testno)
+{
+    char *ptr1 = NULL;
+    char *start = sbrk(0);
+    size_t size = MMAP_THRESHOLD;
+    size_t i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikrealloc 7, mapped blocks\n");
+
+    ptr1 = vikalloc(size);
+    memset(ptr1, 'm', size);
+    // mapped blocks grow by remapping their pages
+    for (size = MMAP_THRESHOLD * 2; size <= MMAP_THRESHOLD * 64; size *= 2) {
+        ptr1 = vikrealloc(ptr1, size);
+        assert(ptr1 != NULL);
+        assert(ptr1[0] == 'm' && ptr1[size / 2 - 1] == 'm');
+        memset(ptr1 + size / 2, 'm', size / 2);
+    }
+    size /= 2;
+    for (i = 0; i < size; i += 4096) {
+        assert(ptr1[i] == 'm');
+    }
+    assert(start == sbrk(0));
+    vikalloc_dump2((long) base);
+
+    // and shrink in place
+    {
+        char *old = ptr1;
+
+        ptr1 = vikrealloc(ptr1, MMAP_THRESHOLD + 10);
+        assert(ptr1 == old);
+        assert(ptr1[MMAP_THRESHOLD + 9] == 'm');
+    }
+    vikalloc_dump2((long) base);
+
+    // below the threshold, the block goes to the heap
+    ptr1 = vikrealloc(ptr1, 1000);
+    assert(ptr1 != NULL);
+    assert(ptr1[0] == 'm' && ptr1[999] == 'm');
+    assert(start != sbrk(0));
+    vikalloc_dump2((long) base);
+    vikfree(ptr1);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
 void
 strdup1(int testno)
 {
@@ -1669,6 +1853,392 @@ strdup1(int testno)
     fprintf(log_stream,"*** End %d\n", testno);
 }
 
+void
+small1(int testno)
+{
+    char *ptrs[NUM_PTRS] = {NULL};
+    int i = 0;
+    char *ptr1 = NULL;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      small objects\n");
+
+    vikalloc_set_small_objects(TRUE);
+    for (i = 0; i < NUM_PTRS; i++) {
+        ptrs[i] = vikalloc((i % 25) * 10 + 1);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], i, (i % 25) * 10 + 1);
+    }
+    // the objects have no header, make sure none of them overlap
+    for (i = 0; i < NUM_PTRS; i++) {
+        assert(ptrs[i][0] == (char) i);
+        assert(ptrs[i][(i % 25) * 10] == (char) i);
+    }
+    vikalloc_dump2((long) base);
+
+    for (i = 0; i < NUM_PTRS; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    // too big for a slab, these move to ordinary blocks
+    for (i = 1; i < NUM_PTRS; i += 2) {
+        ptrs[i] = vikrealloc(ptrs[i], 1000);
+        assert(ptrs[i][0] == (char) i);
+    }
+    vikalloc_dump2((long) base);
+
+    for (i = 1; i < NUM_PTRS; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_dump2((long) base);
+    vikalloc_set_small_objects(FALSE);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == base);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+mmap1(int testno)
+{
+    char *ptrs[5] = {NULL};
+    char *ptr1 = NULL;
+    char *start = sbrk(0);
+    char *top = NULL;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      mmap large blocks\n");
+
+    ptr1 = vikalloc(1000);
+    assert(ptr1 != NULL);
+    top = sbrk(0);
+
+    // none of these come from the heap
+    for (i = 0; i < 5; i++) {
+        ptrs[i] = vikalloc(MMAP_THRESHOLD + i * 50000);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], i + 1, MMAP_THRESHOLD + i * 50000);
+    }
+    assert(top == sbrk(0));
+    for (i = 0; i < 5; i++) {
+        assert(ptrs[i][0] == (char) (i + 1));
+        assert(ptrs[i][MMAP_THRESHOLD + i * 50000 - 1] == (char) (i + 1));
+    }
+    vikalloc_dump2((long) base);
+
+    // a heap block that grows past the threshold moves to a mapping
+    memset(ptr1, 'a', 1000);
+    ptr1 = vikrealloc(ptr1, MMAP_THRESHOLD * 2);
+    assert(ptr1 != NULL);
+    assert(ptr1[0] == 'a' && ptr1[999] == 'a');
+    assert(top == sbrk(0));
+
+    for (i = 0; i < 5; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_dump2((long) base);
+
+    for (i = 1; i < 5; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikfree(ptr1);
+    vikalloc_dump2((long) base);
+
+    // the mappings are gone, a second free only says so
+    vikfree(ptrs[0]);
+    vikfree(ptr1);
+    vikfree_sized(ptrs[1], MMAP_THRESHOLD + 50000);
+    vikalloc_dump2((long) base);
+
+    // the threshold can be moved, but not below a page
+    assert(vikalloc_set_mmap_threshold(0) == MMAP_THRESHOLD);
+    assert(vikalloc_set_mmap_threshold(1) == 4096);
+    ptr1 = vikalloc(5000);
+    assert(top == sbrk(0));
+    vikalloc_dump2((long) base);
+    vikalloc_set_mmap_threshold(MMAP_THRESHOLD);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+trim1(int testno)
+{
+    char *ptrs[NUM_PTRS] = {NULL};
+    char *start = sbrk(0);
+    char *peak = NULL;
+    char *ptr1 = NULL;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      trim the heap\n");
+
+    for (i = 0; i < NUM_PTRS; i++) {
+        ptrs[i] = vikalloc(10000);
+        assert(ptrs[i] != NULL);
+    }
+    peak = sbrk(0);
+
+    // the tail stays until it is larger than the threshold
+    vikfree(ptrs[NUM_PTRS - 1]);
+    assert(sbrk(0) == peak);
+    for (i = NUM_PTRS - 2; i >= NUM_PTRS / 2; i--) {
+        vikfree(ptrs[i]);
+    }
+    assert((char *) sbrk(0) < peak);
+    // half of the threshold is kept
+    assert((char *) sbrk(0) - (char *) ptrs[NUM_PTRS / 2] >= TRIM_THRESHOLD / 2);
+    vikalloc_dump2((long) base);
+
+    // freeing an interior block does not move the break
+    peak = sbrk(0);
+    vikfree(ptrs[0]);
+    assert(sbrk(0) == peak);
+
+    // the heap grows again from the trimmed end
+    for (i = NUM_PTRS / 2; i < NUM_PTRS; i++) {
+        ptrs[i] = vikalloc(10000);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], i, 10000);
+    }
+    for (i = 1; i < NUM_PTRS; i++) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_dump2((long) base);
+
+    // an explicit trim keeps only what it is asked to
+    peak = sbrk(0);
+    assert(vikalloc_trim(0) > 0);
+    assert((char *) sbrk(0) < peak);
+    assert((char *) sbrk(0) - start <= 2 * 4096);
+    assert(vikalloc_trim(0) == 0);
+    vikalloc_dump2((long) base);
+
+    ptr1 = vikalloc(20000);
+    assert(ptr1 != NULL);
+    memset(ptr1, 'a', 20000);
+    vikfree(ptr1);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+// The number of whole pages between start and start + len that are in
+//   memory.
+static int
+resident_pages(char *start, size_t len)
+{
+    unsigned char vec[64] = {0};
+    char *first = (char *) (((long) start + 4095) & ~4095L);
+    char *last = (char *) (((long) start + (long) len) & ~4095L);
+    int pages = 0;
+    int i = 0;
+
+    assert(last - first <= 64 * 4096);
+    if (last <= first) {
+        return 0;
+    }
+    assert(mincore(first, last - first, vec) == 0);
+    for (i = 0; i < (last - first) / 4096; i++) {
+        pages += vec[i] & 1;
+    }
+    return pages;
+}
+
+void
+purge1(int testno)
+{
+    char *ptrs[5] = {NULL};
+    char *start = sbrk(0);
+    char *ptr1 = NULL;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      purge free blocks\n");
+
+    for (i = 0; i < 5; i++) {
+        ptrs[i] = vikalloc(100000);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], i + 1, 100000);
+    }
+
+    // recently free'ed blocks keep their pages
+    vikalloc_set_purge_decay(20);
+    vikfree(ptrs[1]);
+    assert(resident_pages(ptrs[1], 100000) > 20);
+    usleep(50000);
+
+    // the next large vikfree() purges the blocks that have aged
+    vikfree(ptrs[3]);
+    assert(resident_pages(ptrs[1], 100000) == 0);
+    assert(resident_pages(ptrs[3], 100000) > 20);
+    vikalloc_dump2((long) base);
+    vikalloc_set_purge_decay(PURGE_DECAY);
+
+    // an explicit trim does not wait, the headers stay intact
+    assert(vikalloc_trim(0) >= 20 * 4096);
+    assert(resident_pages(ptrs[3], 100000) == 0);
+    assert(ptrs[2][0] == 3 && ptrs[2][99999] == 3);
+    assert(ptrs[4][0] == 5 && ptrs[4][99999] == 5);
+    vikalloc_dump2((long) base);
+
+    // purged blocks are used again like any other
+    ptr1 = vikalloc(100000);
+    assert(ptr1 != NULL);
+    memset(ptr1, 'a', 100000);
+    vikfree(ptr1);
+    for (i = 0; i < 5; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_dump2((long) base);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+calloc4(int testno)
+{
+    char *ptrs[3] = {NULL};
+    char *start = sbrk(0);
+    char *ptr1 = NULL;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikcalloc 4, memory known to be zero\n");
+
+    // fresh from sbrk(), the pages are not even touched
+    ptr1 = vikcalloc(1000, 100);
+    assert(resident_pages(ptr1, 100000) <= 1);
+    for (i = 0; i < 100000; i++) {
+        assert(ptr1[i] == 0);
+    }
+    memset(ptr1, 0xff, 100000);
+    vikfree(ptr1);
+
+    // but a block that was used is cleared
+    ptr1 = vikcalloc(100000, 1);
+    for (i = 0; i < 100000; i++) {
+        assert(ptr1[i] == 0);
+    }
+    vikfree(ptr1);
+    vikalloc_reset();
+
+    // and so are the pages a purge gave back
+    for (i = 0; i < 3; i++) {
+        ptrs[i] = vikalloc(100000);
+        memset(ptrs[i], 0xff, 100000);
+    }
+    vikfree(ptrs[1]);
+    vikalloc_trim(0);
+    ptr1 = vikcalloc(90000, 1);
+    assert(ptr1 == ptrs[1]);
+    assert(resident_pages(ptr1, 90000) <= 1);
+    for (i = 0; i < 90000; i++) {
+        assert(ptr1[i] == 0);
+    }
+    vikalloc_dump2((long) base);
+    vikfree(ptr1);
+    vikfree(ptrs[0]);
+    vikfree(ptrs[2]);
+
+    // nmemb * size must not overflow
+    errno = 0;
+    ptr1 = vikcalloc(((size_t) -1) / 2, 4);
+    assert(ptr1 == NULL && errno == ENOMEM);
+    ptr1 = vikcalloc(MMAP_THRESHOLD, 2);
+    assert(ptr1[0] == 0 && ptr1[MMAP_THRESHOLD * 2 - 1] == 0);
+    vikfree(ptr1);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+#ifdef VIK_THREADS
+#define NUM_THREADS 8
+
+static void *
+threads1_worker(void *arg)
+{
+    char *ptrs[NUM_PTRS] = {NULL};
+    long id = (long) arg;
+    int round = 0;
+    int i = 0;
+
+    for (round = 0; round < 100; round++) {
+        for (i = 0; i < NUM_PTRS; i++) {
+            ptrs[i] = vikalloc((i % 40) * 25 + 1);
+            assert(ptrs[i] != NULL);
+            memset(ptrs[i], (int) id, (i % 40) * 25 + 1);
+        }
+        for (i = 0; i < NUM_PTRS; i++) {
+            assert(ptrs[i][0] == (char) id);
+            assert(ptrs[i][(i % 40) * 25] == (char) id);
+        }
+        for (i = 0; i < NUM_PTRS; i += 2) {
+            vikfree(ptrs[i]);
+        }
+        for (i = 1; i < NUM_PTRS; i += 2) {
+            vikfree(ptrs[i]);
+        }
+    }
+
+    return NULL;
+}
+
+static void *
+threads1_idle(void *arg)
+{
+    return arg;
+}
+
+void
+threads1(int testno)
+{
+    pthread_t threads[NUM_THREADS];
+    long i = 0;
+    char *ptr1 = NULL;
+    char *start = NULL;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      threads\n");
+
+    // the C library moves the break itself the first time threads are
+    //   created, let it do that before the heap starts.
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, threads1_idle, NULL);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    start = sbrk(0);
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, threads1_worker, (void *) i);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // the threads drained their caches when they exited
+    vikalloc_dump2((long) base);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+#endif // VIK_THREADS
+
 void
 bestfit1(int testno)
 {
@@ -1899,3 +2469,749 @@ bestfit6(int testno)
     assert(ptr1 == base);
     fprintf(log_stream, "*** End %d\n", testno);
 }
+
+void
+aligned1(int testno)
+{
+    static const size_t aligns[] = {32, 64, 256, 4096};
+    char *ptrs[20] = {NULL};
+    char *start = sbrk(0);
+    char *ptr1 = NULL;
+    void *ptr2 = NULL;
+    size_t size = 0;
+    int i = 0;
+    int j = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikalloc_aligned, 16 byte aligned by default\n");
+
+    // every block is 16 byte aligned, whatever its size
+    for (i = 0; i < 20; i++) {
+        ptrs[i] = vikalloc(i * 7 + 1);
+        assert(((size_t) ptrs[i] & 15) == 0);
+        memset(ptrs[i], 0xff, i * 7 + 1);
+    }
+    for (i = 0; i < 20; i++) {
+        vikfree(ptrs[i]);
+    }
+    // small objects as well
+    vikalloc_set_small_objects(TRUE);
+    for (i = 0; i < 20; i++) {
+        ptrs[i] = vikalloc(i * 23 + 1);
+        assert(((size_t) ptrs[i] & 15) == 0);
+    }
+    for (i = 0; i < 20; i++) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_set_small_objects(FALSE);
+    vikalloc_reset();
+
+    // larger alignments, in the heap and in mappings of their own
+    for (j = 0; j < 4; j++) {
+        for (i = 0; i < 10; i++) {
+            size = (i & 1) ? (size_t) (i * 100 + 3) : (size_t) (MMAP_THRESHOLD + i * 1000);
+            ptrs[i] = vikalloc_aligned(aligns[j], size);
+            assert(ptrs[i] != NULL);
+            assert(((size_t) ptrs[i] & (aligns[j] - 1)) == 0);
+            memset(ptrs[i], 0xff, size);
+        }
+        vikalloc_dump2((long) base);
+        for (i = 0; i < 10; i++) {
+            vikfree(ptrs[i]);
+        }
+    }
+    vikalloc_dump2((long) base);
+
+    // the gaps in front of aligned blocks are coalesced again, the
+    //   blocks are too big for a thread cache to keep
+    ptr1 = vikalloc(10000);
+    vikfree(ptr1);
+    for (i = 0; i < 10; i++) {
+        ptrs[i] = vikalloc_aligned(256, 600);
+    }
+    for (i = 0; i < 10; i++) {
+        vikfree(ptrs[i]);
+    }
+    ptrs[0] = vikalloc(10000);
+    assert(ptrs[0] == ptr1);
+    vikfree(ptrs[0]);
+
+    // a mapped aligned block can be resized
+    ptr1 = vikalloc_aligned(4096, MMAP_THRESHOLD * 2);
+    memset(ptr1, 0x5a, MMAP_THRESHOLD * 2);
+    ptr1 = vikrealloc(ptr1, MMAP_THRESHOLD * 8);
+    assert(ptr1[0] == 0x5a && ptr1[MMAP_THRESHOLD * 2 - 1] == 0x5a);
+    vikfree(ptr1);
+
+    // mapped blocks that end just short of, on, or just past a page
+    //   boundary, the header and the alignment both come out of the
+    //   mapping and the last byte must still be in it
+    for (size = MMAP_THRESHOLD + 4096 - 80; size <= MMAP_THRESHOLD + 4096 + 16; size++) {
+        ptr1 = vikalloc(size);
+        assert(((size_t) ptr1 & 15) == 0);
+        ptr1[size - 1] = 0x5a;
+        vikfree(ptr1);
+        for (j = 0; j < 4; j++) {
+            ptr1 = vikalloc_aligned(aligns[j], size);
+            assert(((size_t) ptr1 & (aligns[j] - 1)) == 0);
+            ptr1[size - 1] = 0x5a;
+            vikfree(ptr1);
+        }
+    }
+
+    // the posix calls
+    assert(vik_posix_memalign(&ptr2, 64, 1000) == 0);
+    assert(((size_t) ptr2 & 63) == 0);
+    vikfree(ptr2);
+    ptr2 = NULL;
+    assert(vik_posix_memalign(&ptr2, 4, 1000) == EINVAL);
+    assert(vik_posix_memalign(&ptr2, 48, 1000) == EINVAL);
+    assert(ptr2 == NULL);
+    ptr1 = vik_aligned_alloc(128, 5000);
+    assert(((size_t) ptr1 & 127) == 0);
+    vikfree(ptr1);
+    errno = 0;
+    ptr1 = vikalloc_aligned(24, 100);
+    assert(ptr1 == NULL && errno == EINVAL);
+    errno = 0;
+    ptr1 = vikalloc_aligned(64, (size_t) -1);
+    assert(ptr1 == NULL && errno == ENOMEM);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+batch1(int testno)
+{
+    void *ptrs[102] = {NULL};
+    char *start = sbrk(0);
+    char *ptr1 = NULL;
+    size_t n = 0;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikalloc_batch and vikfree_batch\n");
+
+    // the blocks are carved one after the other
+    n = vikalloc_batch(100, 100, ptrs);
+    assert(n == 100);
+    for (i = 0; i < 100; i++) {
+        memset(ptrs[i], i, 100);
+        if (i > 0) {
+            assert((char *) ptrs[i] == (char *) ptrs[i - 1] + 112 + 16);
+        }
+    }
+    for (i = 0; i < 100; i++) {
+        assert(((char *) ptrs[i])[99] == i);
+    }
+    vikalloc_dump2((long) base);
+    ptr1 = ptrs[0];
+
+    // freed out of order, with a NULL and a block passed twice, they
+    //   coalesce into one free block again
+    for (i = 0; i < 50; i++) {
+        void *tmp = ptrs[i];
+
+        ptrs[i] = ptrs[99 - i];
+        ptrs[99 - i] = tmp;
+    }
+    ptrs[100] = ptrs[10];
+    ptrs[101] = NULL;
+    vikfree_batch(ptrs, 102);
+    vikalloc_dump2((long) base);
+    ptrs[0] = vikalloc(100 * 128);
+    assert(ptrs[0] == ptr1);
+    vikfree(ptrs[0]);
+
+#ifdef VIK_THREADS
+    // a block already in the thread cache stays there, it is neither
+    //   free'ed again nor merged with the blocks around it
+    vikalloc_set_thread_cache(TRUE);
+    n = vikalloc_batch(3, 100, ptrs);
+    assert(n == 3);
+    vikfree(ptrs[1]);
+    vikfree_batch(ptrs, 3);
+    ptr1 = vikalloc(100);
+    assert(ptr1 == ptrs[1]);
+    ptrs[0] = vikalloc(300);
+    assert((char *) ptrs[0] >= ptr1 + 100 || (char *) ptrs[0] + 300 <= ptr1);
+    vikfree(ptrs[0]);
+    vikfree(ptr1);
+    vikalloc_set_thread_cache(FALSE);
+#endif // VIK_THREADS
+
+    // small objects and mapped blocks
+    vikalloc_set_small_objects(TRUE);
+    n = vikalloc_batch(100, 40, ptrs);
+    assert(n == 100);
+    for (i = 0; i < 100; i++) {
+        memset(ptrs[i], i, 40);
+    }
+    vikfree_batch(ptrs, 100);
+    vikalloc_set_small_objects(FALSE);
+    n = vikalloc_batch(3, MMAP_THRESHOLD, ptrs);
+    assert(n == 3);
+    for (i = 0; i < 3; i++) {
+        memset(ptrs[i], i, MMAP_THRESHOLD);
+    }
+    vikalloc_dump2((long) base);
+    vikfree_batch(ptrs, 3);
+
+    assert(vikalloc_batch(0, 100, ptrs) == 0);
+    assert(vikalloc_batch(100, 0, ptrs) == 0);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+sized1(int testno)
+{
+    static const size_t sizes[] = {10, 100, 512, 513, 1000, 5000, 20000};
+    char *ptrs[7] = {NULL};
+    char *start = sbrk(0);
+    char *ptr1 = NULL;
+    int i = 0;
+    int j = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikfree_sized\n");
+
+    ptr1 = vikalloc(10000);
+    for (j = 0; j < 2; j++) {
+        // with small objects, and without
+        vikalloc_set_small_objects(j);
+        for (i = 0; i < 7; i++) {
+            ptrs[i] = vikalloc(sizes[i]);
+            memset(ptrs[i], i, sizes[i]);
+        }
+        for (i = 0; i < 7; i += 2) {
+            vikfree_sized(ptrs[i], sizes[i]);
+        }
+        for (i = 1; i < 7; i += 2) {
+            vikfree_sized(ptrs[i], sizes[i]);
+        }
+        vikalloc_dump2((long) base);
+    }
+    vikalloc_set_small_objects(FALSE);
+
+    // the size of a block that was resized, or calloc'ed
+    ptrs[0] = vikrealloc(ptr1, 15000);
+    ptrs[1] = vikcalloc(30, 100);
+    ptrs[2] = vikalloc(MMAP_THRESHOLD + 10);
+    vikfree_sized(ptrs[0], 15000);
+    vikfree_sized(ptrs[1], 3000);
+    vikfree_sized(ptrs[2], MMAP_THRESHOLD + 10);
+    vikfree_sized(NULL, 100);
+    vikalloc_dump2((long) base);
+
+    // a second free of a block only says so, whatever its size
+    ptr1 = vikalloc(1000);
+    ptrs[0] = vikalloc(2000);
+    ptrs[1] = vikalloc(100);
+    ptrs[2] = vikalloc(1000);
+    vikfree_sized(ptrs[0], 2000);
+    vikfree_sized(ptrs[0], 2000);
+    vikfree_sized(ptrs[1], 100);
+    vikfree_sized(ptrs[1], 100);
+    vikfree(ptrs[2]);
+    vikfree(ptr1);
+    vikalloc_dump2((long) base);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+region1(int testno)
+{
+    vikarena_t *region = NULL;
+    char *ptrs[10] = {NULL};
+    char *start = sbrk(0);
+    char *ptr1 = NULL;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikarena regions\n");
+
+    // the objects are bumped one after the other, with no headers
+    region = vikarena_create(1000);
+    for (i = 0; i < 10; i++) {
+        ptrs[i] = vikarena_alloc(region, 10);
+        memset(ptrs[i], i, 10);
+        assert(((size_t) ptrs[i] & 15) == 0);
+        if (i > 0) {
+            assert(ptrs[i] == ptrs[i - 1] + 16);
+        }
+    }
+    ptr1 = ptrs[0];
+    assert(vikarena_alloc(region, 0) == NULL);
+
+    // a reset starts over in the same chunk
+    vikarena_reset(region);
+    assert(vikarena_alloc(region, 10) == ptr1);
+
+    // more chunks come as they are needed, the large ones in mappings
+    for (i = 0; i < 1000; i++) {
+        ptr1 = vikarena_alloc(region, 1000);
+        memset(ptr1, 0xff, 1000);
+    }
+    ptr1 = vikarena_alloc(region, MMAP_THRESHOLD * 2);
+    memset(ptr1, 0xff, MMAP_THRESHOLD * 2);
+    vikalloc_dump2((long) base);
+
+    // only the newest chunk is kept, and the region settles in it
+    vikarena_reset(region);
+    ptr1 = vikarena_alloc(region, 100);
+    vikarena_reset(region);
+    assert(vikarena_alloc(region, 100) == ptr1);
+    vikalloc_dump2((long) base);
+
+    vikarena_destroy(region);
+    vikarena_destroy(NULL);
+    errno = 0;
+    assert(vikarena_create((size_t) -1) == NULL && errno == ENOMEM);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+pool1(int testno)
+{
+    vikpool_t *pool = NULL;
+    vikpool_t *pool2 = NULL;
+    char *ptrs[2000] = {NULL};
+    char *start = sbrk(0);
+    char *ptr1 = NULL;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikpool object pools\n");
+
+    // the objects are carved one after the other
+    pool = vikpool_create(24, 0);
+    pool2 = vikpool_create(100, 64);
+    for (i = 0; i < 2000; i++) {
+        ptrs[i] = vikpool_alloc(pool);
+        memset(ptrs[i], i, 24);
+        assert(((size_t) ptrs[i] & 15) == 0);
+        if (i > 0 && i < 100) {
+            assert(ptrs[i] == ptrs[i - 1] + 32);
+        }
+    }
+    for (i = 0; i < 10; i++) {
+        ptr1 = vikpool_alloc(pool2);
+        assert(((size_t) ptr1 & 63) == 0);
+    }
+    vikalloc_dump2((long) base);
+
+    // the object free'ed last is handed out first
+    for (i = 0; i < 2000; i += 2) {
+        vikpool_free(pool, ptrs[i]);
+    }
+    ptr1 = vikpool_alloc(pool);
+    assert(ptr1 == ptrs[1998]);
+    ptr1 = vikpool_alloc(pool);
+    assert(ptr1 == ptrs[1996]);
+    vikalloc_dump2((long) base);
+
+    vikpool_destroy(pool);
+    vikpool_destroy(pool2);
+    vikpool_destroy(NULL);
+    assert(vikpool_alloc(NULL) == NULL);
+    errno = 0;
+    assert(vikpool_create(24, 24) == NULL && errno == EINVAL);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+stats1(int testno)
+{
+    struct vikalloc_stats stats;
+    char *ptrs[10] = {NULL};
+    char *start = sbrk(0);
+    char *ptr1 = NULL;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikalloc_get_stats\n");
+
+    vikalloc_reset();
+    vikalloc_get_stats(&stats);
+    assert(stats.bytes_requested == 0 && stats.used_blocks == 0 && stats.capacity == 0);
+
+    for (i = 0; i < 10; i++) {
+        ptrs[i] = vikalloc(1000);
+    }
+    ptr1 = vikalloc(MMAP_THRESHOLD);
+    vikalloc_get_stats(&stats);
+    assert(stats.bytes_requested == 10 * 1000 + MMAP_THRESHOLD);
+    assert(stats.used_blocks == 11 && stats.mapped_blocks == 1);
+    assert(stats.free_blocks == 1);
+    // every block in the heap has a header, and so does the epilogue
+    assert(stats.overhead >= 12 * 16);
+    assert(stats.bytes_in_use == 10 * 1008 + MMAP_THRESHOLD + 4096 - 48);
+    assert(stats.capacity == (size_t) ((char *) sbrk(0) - start) + MMAP_THRESHOLD + 4096);
+    assert(stats.sbrk_calls >= 1);
+    vikalloc_dump2((long) base);
+
+    // the free blocks are coalesced, the peak stays
+    for (i = 0; i < 10; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikfree(ptr1);
+    ptrs[1] = vikrealloc(ptrs[1], 600);
+    vikalloc_get_stats(&stats);
+    assert(stats.bytes_requested == 4 * 1000 + 600);
+    assert(stats.used_blocks == 5 && stats.mapped_blocks == 0);
+    assert(stats.free_blocks == 6);
+    assert(stats.peak_requested == 10 * 1000 + MMAP_THRESHOLD);
+    for (i = 1; i < 10; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_get_stats(&stats);
+    assert(stats.bytes_requested == 0 && stats.used_blocks == 0);
+    assert(stats.free_blocks == 1 && stats.bytes_in_use == 0);
+
+    // small objects count as the size of their class, not as the slab
+    //   page they are in
+    vikalloc_set_small_objects(TRUE);
+    for (i = 0; i < 5; i++) {
+        ptrs[i] = vikalloc(48);
+    }
+    for (i = 5; i < 10; i++) {
+        ptrs[i] = vikalloc(1000);
+    }
+    vikalloc_get_stats(&stats);
+    assert(stats.bytes_requested == 5 * 48 + 5 * 1000);
+    vikfree(ptrs[0]);
+    vikfree(ptrs[5]);
+    vikalloc_get_stats(&stats);
+    assert(stats.bytes_requested == 4 * 48 + 4 * 1000);
+    for (i = 1; i < 5; i++) {
+        vikfree(ptrs[i]);
+    }
+    for (i = 6; i < 10; i++) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_set_small_objects(FALSE);
+    vikalloc_get_stats(&stats);
+    assert(stats.bytes_requested == 0);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+frag1(int testno)
+{
+    struct vikalloc_frag frag;
+    char *ptrs[10] = {NULL};
+    char *start = sbrk(0);
+    char *ptr1 = NULL;
+    uint64_t blocks = 0;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikalloc_get_frag\n");
+
+    vikalloc_reset();
+    vikalloc_get_frag(&frag);
+    assert(frag.free_blocks == 0 && frag.largest_free == 0 && frag.external == 0.0);
+
+    for (i = 0; i < 10; i++) {
+        ptrs[i] = vikalloc(1000);
+    }
+    ptr1 = vikalloc(5000);
+    for (i = 0; i < 10; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_get_frag(&frag);
+    vikalloc_dump2((long) base);
+    // five holes of 1008 bytes, and whatever is left at the end
+    assert(frag.largest_free >= 1008);
+    assert(frag.histogram[9] >= 5);
+    for (i = 0; i < 64; i++) {
+        blocks += frag.histogram[i];
+    }
+    assert(blocks == frag.free_blocks);
+    assert(frag.external > 0.0 && frag.external < 1.0);
+    // the six blocks in use each have 8 bytes they did not ask for
+    assert(frag.internal == 6 * 8);
+
+    // once it all coalesces, the free memory is in one block
+    for (i = 1; i < 10; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikfree(ptr1);
+    vikalloc_get_frag(&frag);
+    assert(frag.free_blocks == 1 && frag.external == 0.0);
+    assert(frag.largest_free == frag.free_bytes);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+// Empty a stream to write into it again.
+static void
+stream_clear(FILE *stream)
+{
+    int ret = 0;
+
+    rewind(stream);
+    ret = ftruncate(fileno(stream), 0);
+    assert(ret == 0);
+    (void) ret;
+}
+
+void
+dump1(int testno)
+{
+    struct vikalloc_stats stats;
+    vikalloc_dump_header_t header;
+    vikalloc_dump_record_t record;
+    char line[256];
+    char buffer[BUFSIZ];
+    char *ptrs[10] = {NULL};
+    char *start = NULL;
+    char *ptr1 = NULL;
+    char *p = NULL;
+    FILE *dump = NULL;
+    uint64_t blocks = 0;
+    uint64_t lines = 0;
+    uint64_t stat_lines = 0;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikalloc_dump_ex\n");
+
+    vikalloc_reset();
+    // stdio takes its memory from the break as well, so the stream is
+    //   set up before the heap is
+    dump = tmpfile();
+    assert(dump != NULL);
+    setvbuf(dump, buffer, _IOFBF, sizeof(buffer));
+    start = sbrk(0);
+    for (i = 0; i < 10; i++) {
+        ptrs[i] = vikalloc(1000);
+    }
+    for (i = 0; i < 10; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_get_stats(&stats);
+    blocks = stats.used_blocks + stats.free_blocks;
+
+    // one block line for each block, then the totals
+    vikalloc_dump_ex(dump, (long) base, VIKALLOC_DUMP_CSV, 0);
+    rewind(dump);
+    assert(fgets(line, sizeof(line), dump) != NULL);
+    assert(strcmp(line, "record,arena,offset,capacity,size,status,stat,value\n") == 0);
+    while (fgets(line, sizeof(line), dump) != NULL) {
+        if (strncmp(line, "block,", 6) == 0) {
+            lines++;
+        }
+        else if (strncmp(line, "stat,,,,,,", 10) == 0) {
+            stat_lines++;
+        }
+        // every line has the eight fields of the header
+        for (i = 0, p = line; (p = strchr(p, ',')) != NULL; p++) {
+            i++;
+        }
+        assert(i == 7);
+    }
+    assert(lines == blocks);
+    assert(stat_lines > 0);
+
+    // every second block only
+    stream_clear(dump);
+    vikalloc_dump_ex(dump, (long) base, VIKALLOC_DUMP_CSV, VIKALLOC_DUMP_EVERY(2));
+    rewind(dump);
+    lines = 0;
+    while (fgets(line, sizeof(line), dump) != NULL) {
+        lines += strncmp(line, "block,", 6) == 0;
+    }
+    assert(lines == (blocks + 1) / 2);
+
+    // the totals without any blocks
+    stream_clear(dump);
+    vikalloc_dump_ex(dump, (long) base, VIKALLOC_DUMP_CSV, VIKALLOC_DUMP_SUMMARY);
+    rewind(dump);
+    lines = 0;
+    while (fgets(line, sizeof(line), dump) != NULL) {
+        lines += strncmp(line, "block,", 6) == 0;
+    }
+    assert(lines == 0);
+
+    stream_clear(dump);
+    vikalloc_dump_ex(dump, (long) base, VIKALLOC_DUMP_JSON, 0);
+    rewind(dump);
+    lines = 0;
+    assert(fgetc(dump) == '{');
+    while (fgets(line, sizeof(line), dump) != NULL) {
+        lines += strncmp(line, "{\"arena\":", 9) == 0;
+    }
+    assert(lines == blocks);
+
+    // a mapped block shows up in the binary dump as well
+    ptr1 = vikalloc(MMAP_THRESHOLD + 1000);
+    stream_clear(dump);
+    vikalloc_dump_ex(dump, (long) base, VIKALLOC_DUMP_BINARY, 0);
+    rewind(dump);
+    assert(fread(&header, sizeof(header), 1, dump) == 1);
+    assert(memcmp(header.magic, "VIKD", 4) == 0);
+    assert(header.version == 1 && header.record_size == sizeof(record));
+    lines = 0;
+    for (;;) {
+        assert(fread(&record, sizeof(record), 1, dump) == 1);
+        if (record.status == VIKALLOC_BLOCK_END) {
+            break;
+        }
+        if (record.status == VIKALLOC_BLOCK_MAPPED) {
+            assert(record.size == MMAP_THRESHOLD + 1000);
+        }
+        lines++;
+    }
+    assert(lines == blocks + 1);
+    assert(fread(&stats, sizeof(stats), 1, dump) == 1);
+    assert(stats.mapped_blocks == 1);
+    vikfree(ptr1);
+
+    for (i = 1; i < 10; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fclose(dump);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
+
+void
+trace1(int testno)
+{
+    vikalloc_trace_header_t header;
+    vikalloc_trace_record_t records[8];
+    vikalloc_trace_record_t record;
+    char buffer[BUFSIZ];
+    char *start = NULL;
+    char *ptr1 = NULL;
+    char *ptr2 = NULL;
+    char *ptr3 = NULL;
+    char *ptr4 = NULL;
+    char *ptrs[3000] = {NULL};
+    void *batch[3] = {NULL};
+    FILE *trace = NULL;
+    uint64_t count = 0;
+    uint64_t time = 0;
+    int i = 0;
+
+    fprintf(log_stream, "*** Begin %d\n", testno);
+    fprintf(log_stream, "      vikalloc_set_trace\n");
+
+    vikalloc_reset();
+    trace = tmpfile();
+    assert(trace != NULL);
+    setvbuf(trace, buffer, _IOFBF, sizeof(buffer));
+    start = sbrk(0);
+    vikalloc_set_trace(trace);
+
+    ptr1 = vikalloc(100);
+    ptr2 = vikcalloc(10, 30);
+    ptr3 = vikstrdup("a string to trace");
+    ptr4 = vikrealloc(ptr1, 5000);
+    vikfree(NULL);
+    assert(vikalloc(0) == NULL);
+    vikfree(ptr4);
+    vikfree_sized(ptr2, 300);
+    vikfree(ptr3);
+    vikalloc_set_trace(NULL);
+    // not traced any more
+    vikfree(vikalloc(100));
+
+    rewind(trace);
+    assert(fread(&header, sizeof(header), 1, trace) == 1);
+    assert(memcmp(header.magic, "VIKT", 4) == 0);
+    assert(header.version == 1 && header.record_size == sizeof(record));
+    assert(fread(records, sizeof(record), 8, trace) == 7);
+    assert(records[0].op == VIKALLOC_TRACE_ALLOC && records[0].size == 100);
+    assert(records[0].ptr == (uintptr_t) ptr1);
+    assert(records[1].op == VIKALLOC_TRACE_CALLOC && records[1].size == 300);
+    assert(records[1].ptr == (uintptr_t) ptr2);
+    assert(records[2].op == VIKALLOC_TRACE_STRDUP && records[2].size == 18);
+    assert(records[3].op == VIKALLOC_TRACE_REALLOC && records[3].size == 5000);
+    assert(records[3].ptr == (uintptr_t) ptr4 && records[3].old_ptr == (uintptr_t) ptr1);
+    assert(records[4].op == VIKALLOC_TRACE_FREE && records[4].ptr == (uintptr_t) ptr4);
+    assert(records[5].op == VIKALLOC_TRACE_FREE && records[5].size == 300);
+    assert(records[6].op == VIKALLOC_TRACE_FREE && records[6].ptr == (uintptr_t) ptr3);
+    for (i = 0; i < 7; i++) {
+        assert(records[i].thread == records[0].thread && records[i].thread != 0);
+        assert(records[i].time >= time);
+        time = records[i].time;
+    }
+
+    // more records than fit in the buffer of the thread
+    stream_clear(trace);
+    vikalloc_set_trace(trace);
+    for (i = 0; i < 3000; i++) {
+        ptrs[i] = vikalloc(i + 1);
+    }
+    for (i = 0; i < 3000; i++) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_trace_flush();
+    rewind(trace);
+    assert(fread(&header, sizeof(header), 1, trace) == 1);
+    while (fread(&record, sizeof(record), 1, trace) == 1) {
+        assert(record.op == (count < 3000 ? VIKALLOC_TRACE_ALLOC : VIKALLOC_TRACE_FREE));
+        assert(record.ptr == (uintptr_t) ptrs[count % 3000]);
+        count++;
+    }
+    assert(count == 6000);
+    vikalloc_set_trace(NULL);
+
+    // an aligned call is a vikalloc, the batch calls give a record for
+    //   each of their blocks
+    stream_clear(trace);
+    vikalloc_set_trace(trace);
+    ptr1 = vikalloc_aligned(64, 1000);
+    assert(vikalloc_batch(3, 200, batch) == 3);
+    vikfree_batch(batch, 3);
+    vikfree(ptr1);
+    vikalloc_set_trace(NULL);
+    rewind(trace);
+    assert(fread(&header, sizeof(header), 1, trace) == 1);
+    assert(fread(records, sizeof(record), 8, trace) == 8);
+    assert(fread(&record, sizeof(record), 1, trace) == 0);
+    assert(records[0].op == VIKALLOC_TRACE_ALLOC && records[0].size == 1000);
+    assert(records[0].ptr == (uintptr_t) ptr1);
+    for (i = 1; i < 4; i++) {
+        assert(records[i].op == VIKALLOC_TRACE_ALLOC && records[i].size == 200);
+        assert(records[i + 3].op == VIKALLOC_TRACE_FREE);
+        assert(records[i + 3].ptr == records[i].ptr);
+    }
+    assert(records[7].op == VIKALLOC_TRACE_FREE && records[7].ptr == (uintptr_t) ptr1);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == start);
+    fclose(trace);
+    fprintf(log_stream, "*** End %d\n", testno);
+}
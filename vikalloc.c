@@ -4,33 +4,680 @@
 //reference: Vikalloc, vikfree: I got help from a very good TA, Sean. 
 
 
+// for mremap()
+#define _GNU_SOURCE
 #include "vikalloc.h"
+#include <time.h>
+
+#ifdef VIK_THREADS
+# include <pthread.h>
+
+// The owner of an in-use block reads its capacity and writes its size
+//   without the heap lock, while the heap, under the lock, reads the size
+//   and flips the flags in the capacity of the blocks next to the ones
+//   it works on. Each field only has one writer at a time, so plain
+//   (relaxed) loads and stores are enough, no locked instructions.
+# define SHARED_LOAD(__field) __atomic_load_n(&(__field), __ATOMIC_RELAXED)
+# define SHARED_STORE(__field, __value) __atomic_store_n(&(__field), (__value), __ATOMIC_RELAXED)
+# define SHARED_OR(__field, __bits) SHARED_STORE(__field, SHARED_LOAD(__field) | (__bits))
+# define SHARED_AND(__field, __bits) SHARED_STORE(__field, SHARED_LOAD(__field) & (__bits))
+// for the counters that every thread adds to
+# define SHARED_ADD(__field, __value) __atomic_add_fetch(&(__field), (__value), __ATOMIC_RELAXED)
+#else // VIK_THREADS
+# define SHARED_LOAD(__field) (__field)
+# define SHARED_STORE(__field, __value) ((__field) = (__value))
+# define SHARED_OR(__field, __bits) ((__field) |= (__bits))
+# define SHARED_AND(__field, __bits) ((__field) &= (__bits))
+# define SHARED_ADD(__field, __value) ((__field) += (__value))
+#endif // VIK_THREADS
 
 #define BLOCK_SIZE (sizeof(mem_block_t))
 #define BLOCK_DATA(__curr) (((void *)__curr) + (BLOCK_SIZE))
 #define DATA_BLOCK(__data) ((mem_block_t *)(__data - BLOCK_SIZE))
 
-#define IS_FREE(__curr) ((__curr->size) == 0)
+#define IS_FREE(__curr) (SHARED_LOAD((__curr)->size) == 0)
+
+// Capacities are kept a multiple of ALIGNMENT, which leaves the low
+//   bits of the capacity field free to hold flags about the block.
+// With the headers being 16 bytes, every block's data is 16 byte aligned,
+//   as SSE loads and long double need.
+#define ALIGNMENT 16
+#define ALIGN(__size) (((__size) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+#define FLAG_MASK (ALIGNMENT - 1)
+// Set when the block physically before this one is free.
+#define PREV_FREE ((size_t) 0x1)
+// Set in the size of an in-use block while it sits in a thread cache.
+//   It stays out of the capacity, whose flags the neighbours of the
+//   block update under the heap lock.
+#define CACHED (((size_t) 1) << (sizeof(size_t) * 8 - 1))
+// Set on blocks that have a mapping of their own, see map_alloc().
+#define MAPPED ((size_t) 0x2)
+// Set on free blocks whose inside pages were given back, see heap_purge().
+#define PURGED ((size_t) 0x4)
+
+#define BLOCK_CAP(__curr) (SHARED_LOAD((__curr)->capacity) & ~FLAG_MASK)
+#define PREV_IS_FREE(__curr) ((SHARED_LOAD((__curr)->capacity) & PREV_FREE) != 0)
+#define IS_MAPPED(__curr) ((SHARED_LOAD((__curr)->capacity) & MAPPED) != 0)
+#define IS_PURGED(__curr) ((SHARED_LOAD((__curr)->capacity) & PURGED) != 0)
+
+// Boundary tags: a free block repeats its capacity in the last word of
+//   its data, so the block after it can find it by pointer arithmetic.
+// In-use blocks do not have a footer.
+#define NEXT_BLOCK(__curr) ((mem_block_t *) (BLOCK_DATA(__curr) + BLOCK_CAP(__curr)))
+#define BLOCK_FOOTER(__curr) (((size_t *) NEXT_BLOCK(__curr)) - 1)
+#define PREV_BLOCK(__curr) \
+    ((mem_block_t *) (((void *) (__curr)) - ((size_t *) (__curr))[-1] - BLOCK_SIZE))
+// Large free blocks also keep the time they were free'ed, in the word
+//   before the footer.
+#define BLOCK_STAMP(__curr) (BLOCK_FOOTER(__curr) - 1)
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (((size_t) 1) << PAGE_SHIFT)
+
+// Small objects live in slabs, heap blocks filling exactly one page with
+//   equally sized objects. The objects have no header, their size class
+//   comes from the page map. The classes go up in steps of SMALL_QUANTUM,
+//   which keeps every object as aligned as a block's data.
+#define SMALL_QUANTUM ALIGNMENT
+#define SMALL_MAX 512
+#define NUM_SMALL_CLASSES (SMALL_MAX / SMALL_QUANTUM)
+#define SMALL_CLASS(__size) ((unsigned) (((__size) - 1) / SMALL_QUANTUM))
+#define CLASS_SIZE(__class) (((__class) + 1) * SMALL_QUANTUM)
+
+// A bitmap tracks which objects of a slab are in use, one bit each.
+#define SLAB_MAP_BITS 64
+#define SLAB_MAP_WORDS ((PAGE_SIZE / SMALL_QUANTUM) / SLAB_MAP_BITS)
+
+typedef struct slab_s {
+    uint16_t obj_size;  // 0 when the page is not a slab
+    uint16_t nobjs;
+    uint16_t nfree;
+    uint16_t hint;      // no free objects in the map words before this one
+    void *page;
+    struct slab_s *prev;
+    struct slab_s *next;
+    uint64_t map[SLAB_MAP_WORDS];
+} slab_t;
+
+// The page map is a three level radix tree over the page number of an
+//   address. The leaves are arrays of slab_t, one for every page.
+//   35 bits of page number cover the 47 bit user address space.
+#define PM_LEAF_BITS 12
+#define PM_MID_BITS 12
+#define PM_ROOT_BITS 11
+#define PM_LEAF_SIZE (1 << PM_LEAF_BITS)
+#define PM_MID_SIZE (1 << PM_MID_BITS)
+#define PM_ROOT_SIZE (1 << PM_ROOT_BITS)
+
+// Blocks at or above the mmap threshold get a mapping of their own. The
+//   header of such a block links it into the list of mapped blocks, in
+//   front of the usual mem_block_t. The magic number tells a live header
+//   from whatever was mapped in its place after a free.
+typedef struct map_header_s {
+    struct map_header_s *prev;
+    struct map_header_s *next;
+    size_t magic;
+    mem_block_t block;
+} map_header_t;
+
+#define MAP_MAGIC ((size_t) 0x76696b6d6170ULL)
+
+#define MAP_HEADER(__curr) ((map_header_t *) (((void *) (__curr)) - offsetof(map_header_t, block)))
+// An aligned block may start further into its mapping, but its header is
+//   always in the first page.
+#define MAP_START(__map) ((void *) ((size_t) (__map) & ~(PAGE_SIZE - 1)))
+#define MAP_LENGTH(__map) ((size_t) (BLOCK_DATA(&(__map)->block) - MAP_START(__map)) \
+                           + BLOCK_CAP(&(__map)->block))
+
+// A region hands out memory from chunks it gets from vikalloc(), by
+//   moving a pointer up through the newest chunk. The objects have no
+//   headers, the chunks are only linked to each other.
+typedef struct vikarena_chunk_s {
+    struct vikarena_chunk_s *next;
+} vikarena_chunk_t;
+
+struct vikarena_s {
+    vikarena_chunk_t *chunks; // newest first
+    void *ptr;
+    void *end;
+    size_t chunk_size; // of the next chunk
+};
+
+// A pool hands out objects of one size from chunks it gets from
+//   vikalloc(). A free object holds the link to the next free one, and
+//   the chunks are linked through the word after their last object.
+//   The pools are listed for vikalloc_dump2().
+struct vikpool_s {
+    struct vikpool_s *prev;
+    struct vikpool_s *next;
+    void *free_list;
+    // the rest of the newest chunk, no object there was handed out yet
+    void *carve;
+    void *carve_end;
+    void *chunks; // newest first
+    size_t object_size;
+    size_t alignment;
+    size_t chunk_objects;
+    // read by vikalloc_dump2() from other threads
+    size_t num_chunks;
+    size_t in_use;
+};
+
+#define CHUNK_DATA(__chunk) (((void *) (__chunk)) + ALIGN(sizeof(vikarena_chunk_t)))
+
+// The heap always ends with an epilogue, a zero capacity block that is
+//   never free, so the last real block has a next block to look at.
+#define EPILOGUE() ((mem_block_t *) (heap->high_water_mark - BLOCK_SIZE))
 
 #define PTR "0x%07lx"
 #define PTR_T PTR "\t"
 
-static mem_block_t *block_list_head = NULL;
-static mem_block_t *block_list_tail = NULL;
-
-static void *low_water_mark = NULL;
-static void *high_water_mark = NULL;
-// only used in next-fit algorithm
-static mem_block_t *prev_fit = NULL;
+// Free blocks are kept in segregated size-class bins so that vikalloc()
+//   does not have to walk every block in the heap to find room.
+// Each power of two is split into BIN_SUB_CLASSES bins. The bin links
+//   live in the (unused) data portion of the free block.
+typedef struct free_links_s {
+    mem_block_t *prev_free;
+    mem_block_t *next_free;
+} free_links_t;
+
+// For best and worst fit, the free blocks are kept in a red-black tree
+//   ordered by capacity, with the address of the block breaking ties.
+// For next fit, the same tree is ordered by address, and each block
+//   keeps the largest capacity under it, which leads the search from the
+//   roving pointer straight to the next block that fits.
+typedef struct free_tree_s {
+    mem_block_t *left;
+    mem_block_t *right;
+    mem_block_t *parent;
+    size_t max_capacity;
+    uint8_t red;
+} free_tree_t;
+
+// Only the structure for the current fit algorithm is kept up to date,
+//   so the links can share the same space.
+typedef union free_node_u {
+    free_links_t bin;
+    free_tree_t tree;
+} free_node_t;
+
+#define FREE_LINKS(__curr) (&((free_node_t *) BLOCK_DATA(__curr))->bin)
+#define FREE_TREE(__curr) (&((free_node_t *) BLOCK_DATA(__curr))->tree)
+
+// Every block must be able to hold the free links and the footer once
+//   it is free'ed.
+#define MIN_CAPACITY ALIGN(sizeof(free_node_t) + sizeof(size_t))
+
+// Only free blocks this large are purged, smaller ones have too few
+//   pages between their links and their footer to bother.
+#define PURGE_MIN (4 * PAGE_SIZE)
+
+#define BIN_SUB_BITS 2
+#define BIN_SUB_CLASSES (1 << BIN_SUB_BITS)
+#define NUM_BINS (64 * BIN_SUB_CLASSES)
+#define BIN_MAP_BITS 64
+#define BIN_MAP_WORDS (NUM_BINS / BIN_MAP_BITS)
+
+#define FRAG_HIST_BINS 64
+#define FRAG_HIST_BIN(__capacity) ((unsigned) (63 - __builtin_clzl(__capacity)))
+
+// An arena is a heap of its own: its blocks, the structures that track
+//   the free ones and its slabs. The single threaded build only has the
+//   main arena, the one that grows with sbrk().
+typedef struct arena_s {
+    // The first block in the heap, the rest are found through NEXT_BLOCK().
+    mem_block_t *block_list_head;
+    void *low_water_mark;
+    void *high_water_mark;
+    // only used in next-fit algorithm, the last block handed out
+    mem_block_t *prev_fit;
+
+    mem_block_t *bins[NUM_BINS];
+    // one bit per bin, set when the bin is not empty
+    uint64_t bin_map[BIN_MAP_WORDS];
+    mem_block_t *tree_root;
+    // the largest block in the tree, for worst fit
+    mem_block_t *tree_max;
+
+    // slabs with at least one free object, per size class
+    slab_t *slab_partial[NUM_SMALL_CLASSES];
+    // when the free blocks were last checked for purging, in ms
+    size_t purge_time;
+    // Nothing at or above clean has been handed out since the memory came
+    //   from the system, so it is all zero, up to the footer of the last
+    //   block. See block_zero().
+    void *clean;
+    // Kept up to date as blocks are split, coalesced and indexed, so
+    //   vikalloc_get_stats() does not walk the heap. The epilogue is not
+    //   counted in num_blocks.
+    size_t num_blocks;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t sbrk_calls;
+    // free blocks by the log2 of their capacity
+    size_t free_histogram[FRAG_HIST_BINS];
+#ifdef VIK_THREADS
+    pthread_mutex_t lock;
+    uint8_t ready;
+    // The other arenas live in a region reserved with mmap(), where
+    //   region_brk plays the part of the break. NULL for the main arena.
+    void *region;
+    void *region_brk;
+#endif // VIK_THREADS
+} arena_t;
+
+#ifdef VIK_THREADS
+# ifndef MAX_ARENAS
+#  define MAX_ARENAS 64
+# endif // MAX_ARENAS
+# define NUM_ARENAS MAX_ARENAS
+#else // VIK_THREADS
+# define NUM_ARENAS 1
+#endif // VIK_THREADS
+
+// arenas[0] is the main arena
+static arena_t arenas[NUM_ARENAS];
+#ifdef VIK_THREADS
+// the arena the calling thread works on, its lock is held
+static __thread arena_t *heap = NULL;
+#else // VIK_THREADS
+static arena_t *heap = &arenas[0];
+#endif // VIK_THREADS
+
+static slab_t **page_map[PM_ROOT_SIZE] = {NULL};
+static map_header_t *map_list = NULL;
+static vikpool_t *pool_list = NULL;
+// the mapped blocks, the bytes of their mappings and their capacity
+static size_t map_count = 0;
+static size_t map_bytes = 0;
+static size_t map_capacity = 0;
+// the sizes of the blocks in use, whatever arena or mapping they are in
+static size_t stats_requested = 0;
+static size_t stats_peak = 0;
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static size_t trim_threshold = TRIM_THRESHOLD;
+static size_t purge_decay = PURGE_DECAY;
+static size_t slab_count = 0;
+static uint8_t small_objects = FALSE;
 
 static uint8_t isVerbose = FALSE;
 static vikalloc_fit_algorithm_t fit_algorithm = FIRST_FIT;
 static FILE *vikalloc_log_stream = NULL;
 
 static void init_streams(void) __attribute__((constructor));
+static void trace_fini(void) __attribute__((destructor));
+static void free_rebuild(void);
+static void heap_free(void *ptr);
+#ifdef VIK_THREADS
+typedef struct thread_cache_s thread_cache_t;
+static thread_cache_t *cache_get(void);
+static void cache_flush(thread_cache_t *cache, unsigned class, unsigned count);
+#endif // VIK_THREADS
 
 static size_t min_sbrk_size = MIN_SBRK_SIZE;
 
+#ifdef VIK_THREADS
+// Each arena has its own lock. A thread allocates from the arena it was
+//   handed, round-robin, the first time it needed one. A thread that
+//   keeps finding its arena locked by others moves on to another one.
+// Blocks are free'ed back to the arena they came from, whichever
+//   thread frees them.
+# define HEAP_LOCK() arena_lock_home()
+# define HEAP_LOCK_PTR(__ptr) arena_lock(arena_of(__ptr))
+// TRUE if __ptr is in the arena that is locked
+# define HEAP_HAS(__ptr) (arena_of(__ptr) == heap)
+# define HEAP_UNLOCK() pthread_mutex_unlock(&heap->lock)
+// for the calls that work on all of the arenas
+# define HEAP_LOCK_ALL() arena_lock_all()
+# define HEAP_UNLOCK_ALL() arena_unlock_all()
+// the list of mapped blocks is not part of any arena
+# define MAP_LOCK() pthread_mutex_lock(&map_lock)
+# define MAP_UNLOCK() pthread_mutex_unlock(&map_lock)
+// and neither is the list of pools
+# define POOL_LOCK() pthread_mutex_lock(&pool_lock)
+# define POOL_UNLOCK() pthread_mutex_unlock(&pool_lock)
+// and the trace stream is written by one thread at a time
+# define TRACE_LOCK() pthread_mutex_lock(&trace_lock)
+# define TRACE_UNLOCK() pthread_mutex_unlock(&trace_lock)
+# define ARENA_READY(__arena) __atomic_load_n(&(__arena)->ready, __ATOMIC_ACQUIRE)
+
+// The regions are aligned to their size, so the arena an address
+//   belongs to is found from its top bits.
+# define ARENA_SHIFT 30
+# define ARENA_RESERVE (((size_t) 1) << ARENA_SHIFT)
+# define ARENA_MAP_SIZE (((size_t) 1) << (47 - ARENA_SHIFT))
+# define ARENA_MIGRATE_AFTER 8
+
+// Serializes setting up arenas and the calls that lock all of them.
+static pthread_mutex_t arena_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+// the number of arenas handed out to threads, set on first use
+static unsigned arena_count = 0;
+static unsigned arena_next = 0;
+// index into arenas of the region an address is in, 0 for the rest
+static uint8_t arena_map[ARENA_MAP_SIZE] = {0};
+static __thread arena_t *thread_arena = NULL;
+static __thread unsigned thread_contention = 0;
+
+// The heap is shared by all threads and locked per arena.
+// In front of it, each thread keeps a cache of blocks per small size
+//   class, so most calls never take a lock. A lock is only taken to
+//   move CACHE_BATCH blocks at a time in or out of a cache.
+# define CACHE_MAX SMALL_MAX
+# define CACHE_DEPTH 32
+# define CACHE_BATCH 8
+// The cached blocks are linked through their first word. The low bit
+//   of a link is set when it points to an ordinary block rather than a
+//   small object, which saves a page map lookup on the way out.
+# define CACHE_NEXT(__ptr) (*((uintptr_t *) (__ptr)))
+# define CACHE_BLOCK ((uintptr_t) 0x1)
+
+struct thread_cache_s {
+    uintptr_t head[NUM_SMALL_CLASSES];
+    uint16_t count[NUM_SMALL_CLASSES];
+    // the cached blocks are dropped when this falls behind heap_generation
+    unsigned long generation;
+    uint8_t registered;
+};
+
+static __thread thread_cache_t thread_cache;
+// bumped by vikalloc_reset(), which takes every cached block with it
+static unsigned long heap_generation = 0;
+// used to drain the cache of a thread when it exits
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static uint8_t thread_caching = TRUE;
+
+// Set up arena i the first time it is used. The region of an arena is
+//   reserved, not committed, the pages are only backed when touched.
+static arena_t *
+arena_ready(unsigned i)
+{
+    arena_t *arena = &arenas[i];
+    void *region = NULL;
+    size_t lead = 0;
+
+    if (ARENA_READY(arena))
+    {
+        return arena;
+    }
+    pthread_mutex_lock(&arena_init_lock);
+    if (!arena->ready && i != 0)
+    {
+        // reserve twice the room and trim it down to an aligned region
+        region = mmap(NULL, 2 * ARENA_RESERVE, PROT_READ | PROT_WRITE
+                      , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED)
+        {
+            pthread_mutex_unlock(&arena_init_lock);
+            return arena_ready(0);
+        }
+        lead = (ARENA_RESERVE - ((size_t) region & (ARENA_RESERVE - 1))) & (ARENA_RESERVE - 1);
+        if (lead != 0)
+        {
+            munmap(region, lead);
+        }
+        munmap(region + lead + ARENA_RESERVE, ARENA_RESERVE - lead);
+        arena->region = arena->region_brk = region + lead;
+        arena_map[((size_t) arena->region) >> ARENA_SHIFT] = (uint8_t) i;
+    }
+    if (!arena->ready)
+    {
+        pthread_mutex_init(&arena->lock, NULL);
+        __atomic_store_n(&arena->ready, TRUE, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&arena_init_lock);
+
+    return arena;
+}
+
+// Hand the next arena to a thread, round-robin. The first thread to
+//   allocate gets the main arena.
+static arena_t *
+arena_assign(void)
+{
+    long cpus = 0;
+
+    if (__atomic_load_n(&arena_count, __ATOMIC_RELAXED) == 0)
+    {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        __atomic_store_n(&arena_count, (unsigned) MIN(MAX_ARENAS, MAX(2 * cpus, 1))
+                         , __ATOMIC_RELAXED);
+    }
+
+    return arena_ready(__atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED)
+                       % __atomic_load_n(&arena_count, __ATOMIC_RELAXED));
+}
+
+static arena_t *
+arena_of(void *ptr)
+{
+    return &arenas[arena_map[((size_t) ptr) >> ARENA_SHIFT]];
+}
+
+static void
+arena_lock(arena_t *arena)
+{
+    pthread_mutex_lock(&arena->lock);
+    heap = arena;
+}
+
+// Lock the arena of the calling thread.
+static void
+arena_lock_home(void)
+{
+    arena_t *arena = thread_arena;
+
+    if (arena == NULL)
+    {
+        arena = thread_arena = arena_assign();
+    }
+    if (pthread_mutex_trylock(&arena->lock) != 0)
+    {
+        if (++thread_contention >= ARENA_MIGRATE_AFTER)
+        {
+            // too many waits, try our luck in another arena
+            thread_contention = 0;
+            arena = thread_arena = arena_assign();
+        }
+        pthread_mutex_lock(&arena->lock);
+    }
+    else if (thread_contention > 0)
+    {
+        thread_contention--;
+    }
+    heap = arena;
+}
+
+// No arena can be set up while all of them are locked, they are
+//   always taken in the same order.
+static void
+arena_lock_all(void)
+{
+    unsigned i = 0;
+
+    arena_ready(0);
+    pthread_mutex_lock(&arena_init_lock);
+    for (i = 0; i < NUM_ARENAS; i++)
+    {
+        if (arenas[i].ready)
+        {
+            pthread_mutex_lock(&arenas[i].lock);
+        }
+    }
+}
+
+static void
+arena_unlock_all(void)
+{
+    unsigned i = 0;
+
+    for (i = NUM_ARENAS; i-- > 0; )
+    {
+        if (arenas[i].ready)
+        {
+            pthread_mutex_unlock(&arenas[i].lock);
+        }
+    }
+    pthread_mutex_unlock(&arena_init_lock);
+}
+#else // VIK_THREADS
+# define HEAP_LOCK()
+# define HEAP_LOCK_PTR(__ptr)
+# define HEAP_HAS(__ptr) TRUE
+# define HEAP_UNLOCK()
+# define HEAP_LOCK_ALL()
+# define HEAP_UNLOCK_ALL()
+# define MAP_LOCK()
+# define MAP_UNLOCK()
+# define POOL_LOCK()
+# define POOL_UNLOCK()
+# define TRACE_LOCK()
+# define TRACE_UNLOCK()
+# define ARENA_READY(__arena) TRUE
+#endif // VIK_THREADS
+
+// Tracing. A thread records its calls into a buffer of its own, mapped
+//   the first time it traces, and only takes trace_lock to write the
+//   buffer out when it fills.
+// Reading the clock costs more than the rest of a record, so unless
+//   TRACE_PRECISE is defined it is read once for each buffer, and the
+//   records in it count on from there one nanosecond at a time.
+typedef struct trace_buffer_s {
+    uint32_t thread;
+    uint32_t count;
+    uint64_t time;            // of the first record in the buffer
+    vikalloc_trace_record_t records[TRACE_RECORDS];
+} trace_buffer_t;
+
+static FILE *trace_stream = NULL;
+static uint32_t trace_threads = 0;
+#ifdef VIK_THREADS
+static __thread trace_buffer_t *trace_buffer = NULL;
+// used to write out and unmap the buffer of a thread when it exits
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+#else // VIK_THREADS
+static trace_buffer_t *trace_buffer = NULL;
+#endif // VIK_THREADS
+
+// Only a load and a test when tracing is off.
+#define TRACE(__op, __ptr, __old, __size) \
+    do { \
+        if (SHARED_LOAD(trace_stream) != NULL) \
+        { \
+            trace_record((__op), (__ptr), (__old), (__size)); \
+        } \
+    } while (0)
+
+static void
+trace_flush(trace_buffer_t *buffer)
+{
+    TRACE_LOCK();
+    if (trace_stream != NULL && buffer->count > 0)
+    {
+        fwrite(buffer->records, sizeof(vikalloc_trace_record_t), buffer->count, trace_stream);
+    }
+    TRACE_UNLOCK();
+    buffer->count = 0;
+}
+
+#ifdef VIK_THREADS
+static void
+trace_exit(void *arg)
+{
+    trace_flush(arg);
+    munmap(arg, sizeof(trace_buffer_t));
+    trace_buffer = NULL;
+}
+
+static void
+trace_key_create(void)
+{
+    pthread_key_create(&trace_key, trace_exit);
+}
+#endif // VIK_THREADS
+
+static void
+trace_record(vikalloc_trace_op_t op, void *ptr, void *old_ptr, size_t size)
+{
+    trace_buffer_t *buffer = trace_buffer;
+    vikalloc_trace_record_t *record = NULL;
+    struct timespec now;
+    uint64_t time = 0;
+
+    if (buffer == NULL)
+    {
+        buffer = mmap(NULL, sizeof(trace_buffer_t), PROT_READ | PROT_WRITE
+                      , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+        {
+            return;
+        }
+        buffer->thread = SHARED_ADD(trace_threads, 1);
+#ifdef VIK_THREADS
+        pthread_once(&trace_once, trace_key_create);
+        pthread_setspecific(trace_key, buffer);
+#endif // VIK_THREADS
+        trace_buffer = buffer;
+    }
+    if (buffer->count == TRACE_RECORDS)
+    {
+        trace_flush(buffer);
+    }
+#ifdef TRACE_PRECISE
+    clock_gettime(TRACE_CLOCK, &now);
+    time = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+#else // TRACE_PRECISE
+    if (buffer->count == 0)
+    {
+        clock_gettime(TRACE_CLOCK, &now);
+        time = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+        // never behind the records of the last buffer
+        buffer->time = MAX(time, buffer->time + TRACE_RECORDS);
+    }
+    time = buffer->time + buffer->count;
+#endif // TRACE_PRECISE
+    record = &buffer->records[buffer->count++];
+    record->time = time;
+    record->ptr = (uintptr_t) ptr;
+    record->old_ptr = (uintptr_t) old_ptr;
+    record->size = size;
+    record->thread = buffer->thread;
+    record->op = op;
+}
+
+// A batch call is recorded as one call for each of its blocks.
+static void
+trace_batch(vikalloc_trace_op_t op, void **ptrs, size_t count, size_t size)
+{
+    size_t i = 0;
+
+    if (SHARED_LOAD(trace_stream) == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (ptrs[i] != NULL)
+        {
+            trace_record(op, ptrs[i], NULL, size);
+        }
+    }
+}
+
+// The records of the main thread are written when the program exits.
+static void
+trace_fini(void)
+{
+    if (trace_buffer != NULL)
+    {
+        vikalloc_trace_flush();
+    }
+}
+
 static void
 init_streams(void)
 {
@@ -50,13 +697,71 @@ vikalloc_set_min(size_t size)
         // In the event that it is set to something silly small.
         size = MAX(BLOCK_SIZE + BLOCK_SIZE, SILLY_SBRK_SIZE);
     }
+    HEAP_LOCK_ALL();
     min_sbrk_size = size;
+    HEAP_UNLOCK_ALL();
 
     return min_sbrk_size;
 }
 
+size_t
+vikalloc_set_mmap_threshold(size_t size)
+{
+    if (0 == size)
+    {
+        // just return the current value
+        return SHARED_LOAD(mmap_threshold);
+    }
+    if (size < PAGE_SIZE)
+    {
+        // a mapping is at least a page, smaller blocks belong in the heap
+        size = PAGE_SIZE;
+    }
+    SHARED_STORE(mmap_threshold, size);
+
+    return size;
+}
+
+size_t
+vikalloc_set_trim_threshold(size_t size)
+{
+    if (0 == size)
+    {
+        // just return the current value
+        return trim_threshold;
+    }
+    if (size < PAGE_SIZE)
+    {
+        // the break only gives back whole pages
+        size = PAGE_SIZE;
+    }
+    HEAP_LOCK_ALL();
+    trim_threshold = size;
+    HEAP_UNLOCK_ALL();
+
+    return size;
+}
+
+size_t
+vikalloc_set_purge_decay(size_t msecs)
+{
+    if (0 == msecs)
+    {
+        // just return the current value
+        return purge_decay;
+    }
+    HEAP_LOCK_ALL();
+    purge_decay = msecs;
+    HEAP_UNLOCK_ALL();
+
+    return msecs;
+}
+
 void vikalloc_set_algorithm(vikalloc_fit_algorithm_t algorithm)
 {
+    unsigned i = 0;
+
+    HEAP_LOCK_ALL();
     fit_algorithm = algorithm;
     if (isVerbose)
     {
@@ -80,6 +785,17 @@ void vikalloc_set_algorithm(vikalloc_fit_algorithm_t algorithm)
             break;
         }
     }
+    // the free blocks must be tracked by the structure the new
+    //   algorithm searches.
+    for (i = 0; i < NUM_ARENAS; i++)
+    {
+        heap = &arenas[i];
+        if (ARENA_READY(heap))
+        {
+            free_rebuild();
+        }
+    }
+    HEAP_UNLOCK_ALL();
 }
 
 void vikalloc_set_verbose(uint8_t verbosity)
@@ -96,275 +812,2731 @@ void vikalloc_set_log(FILE *stream)
     vikalloc_log_stream = stream;
 }
 
-void *
-vikalloc(size_t size)
+void
+vikalloc_set_trace(FILE *stream)
 {
-    mem_block_t *curr = NULL;
-    mem_block_t *new = NULL;
-    size_t amount_alc = 0;
-    size_t amount_left = 0;
-
-    // initialize curr
-
-    if (size == 0)
-        return NULL;
+    vikalloc_trace_header_t header;
 
-    if (block_list_head == NULL)
+    // what this thread has recorded goes to the old stream
+    if (trace_buffer != NULL)
     {
-        amount_alc = ((size + BLOCK_SIZE) / min_sbrk_size + 1) * min_sbrk_size;
-        // create a new node with curr
-        curr = (mem_block_t *)sbrk(amount_alc);
-        curr->prev = curr->next = NULL;
-
-        curr->size = size;
-        curr->capacity = amount_alc - BLOCK_SIZE;
-
-        block_list_head = block_list_tail = curr;
-
-        // set up low water mark and high water mark
-        low_water_mark = curr;
-        high_water_mark = low_water_mark + amount_alc;
+        trace_flush(trace_buffer);
     }
-    else // when its not empty
+    TRACE_LOCK();
+    if (trace_stream != NULL)
     {
-        for (curr = block_list_head; curr != NULL; curr = curr->next)
-        {
-            // check if IS_Free, resure the block
-            if (IS_FREE(curr) && curr->capacity >= size)
-            {
-                curr->size = size;
-                return BLOCK_DATA(curr);
-            }
-
-            // check if not IS_free, split the block
-            amount_left = curr->capacity - curr->size;
-            if (!IS_FREE(curr) && amount_left >= size + BLOCK_SIZE)
-            {
-                // create a split node and set up a new node
-                mem_block_t *split_node = (mem_block_t *)(curr->size + BLOCK_DATA(curr));
-
-                split_node->capacity = curr->capacity - curr->size - BLOCK_SIZE;
-                split_node->size = size;
+        fflush(trace_stream);
+    }
+    if (stream != NULL)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "VIKT", 4);
+        header.version = 1;
+        header.record_size = sizeof(vikalloc_trace_record_t);
+        header.clock = TRACE_CLOCK;
+        fwrite(&header, sizeof(header), 1, stream);
+    }
+    SHARED_STORE(trace_stream, stream);
+    TRACE_UNLOCK();
+}
 
-                curr->capacity = curr->size;
-                split_node->prev = curr;
-                split_node->next = curr->next;
+void
+vikalloc_trace_flush(void)
+{
+    if (trace_buffer != NULL)
+    {
+        trace_flush(trace_buffer);
+    }
+    TRACE_LOCK();
+    if (trace_stream != NULL)
+    {
+        fflush(trace_stream);
+    }
+    TRACE_UNLOCK();
+}
 
-                if (curr->next == NULL) // if it's the last node
-                    block_list_tail = split_node;
-                else
-                    curr->next->prev = split_node;
+void vikalloc_set_small_objects(uint8_t enable)
+{
+    HEAP_LOCK_ALL();
+    small_objects = enable;
+    HEAP_UNLOCK_ALL();
+    if (isVerbose)
+    {
+        fprintf(vikalloc_log_stream, "** Small objects %s\n", enable ? "enabled" : "disabled");
+    }
+}
 
-                curr->next = split_node;
-                curr = split_node;
-                return BLOCK_DATA(curr);
-            }
-        }
+void vikalloc_set_thread_cache(uint8_t enable)
+{
+#ifdef VIK_THREADS
+    unsigned class = 0;
 
-        // what if it doesn't have any block fit, we need to create a new block at the end.
-        if (curr == NULL)
+    thread_caching = enable;
+    if (!enable)
+    {
+        for (class = 0; class < NUM_SMALL_CLASSES; class++)
         {
-            size_t new_amount_alc = ((size + BLOCK_SIZE) / min_sbrk_size + 1) * min_sbrk_size;
-            new = (mem_block_t *)sbrk(new_amount_alc);
-            new->next = NULL;
-            new->size = size;
-            new->capacity = new_amount_alc - BLOCK_SIZE;
-
-            block_list_tail->next = new;
-            new->prev = block_list_tail;
-
-            block_list_tail = new;
-            
-            high_water_mark += new_amount_alc; // another way: high_water_mark += new->capacity + BLOCK_SIZE;
-            return BLOCK_DATA(block_list_tail);
+            cache_flush(cache_get(), class, CACHE_DEPTH);
         }
     }
-
+#endif // VIK_THREADS
     if (isVerbose)
     {
-        fprintf(vikalloc_log_stream, ">> %d: %s entry: size = %lu\n", __LINE__, __FUNCTION__, size);
+        fprintf(vikalloc_log_stream, "** Thread cache %s\n", enable ? "enabled" : "disabled");
     }
-
-    return BLOCK_DATA(curr);
 }
 
-static void
-coalesce(mem_block_t *curr)
+// Map a capacity to its size class.
+// Bins 0 - 3 hold the sizes 0 - 3, after that there are
+//   BIN_SUB_CLASSES bins for each power of two.
+static unsigned
+size_to_bin(size_t size)
 {
-    mem_block_t *remove_node = curr->next;
-    
-    curr->capacity += remove_node->capacity + BLOCK_SIZE;
-
-    // doing DLL stuff
+    unsigned lg = 0;
 
-    // middle
-    if (remove_node != block_list_tail && remove_node != block_list_head)
+    if (size < BIN_SUB_CLASSES)
     {
-        curr->next = remove_node->next;
-        remove_node->next->prev = curr;
+        return (unsigned) size;
     }
+    lg = (unsigned) (63 - __builtin_clzl(size));
 
-    // handle the head
-    else if (remove_node == block_list_head)
-    {
+    return ((lg - BIN_SUB_BITS + 1) << BIN_SUB_BITS)
+        + (unsigned) ((size >> (lg - BIN_SUB_BITS)) & (BIN_SUB_CLASSES - 1));
+}
 
-        if (!remove_node->next)
-        {
-            curr->next = remove_node->next;
-            remove_node->next->prev = curr;
-        }
-        else
-        {
-            curr->next = NULL;
-            block_list_tail = curr;
-        }
+static void
+bin_insert(mem_block_t *curr)
+{
+    unsigned bin = size_to_bin(BLOCK_CAP(curr));
+    free_links_t *links = FREE_LINKS(curr);
 
-        block_list_head = curr;
+    links->prev_free = NULL;
+    links->next_free = heap->bins[bin];
+    if (heap->bins[bin] != NULL)
+    {
+        FREE_LINKS(heap->bins[bin])->prev_free = curr;
     }
+    heap->bins[bin] = curr;
+    heap->bin_map[bin / BIN_MAP_BITS] |= ((uint64_t) 1) << (bin % BIN_MAP_BITS);
+}
 
-    // handle the tail
-    else if (remove_node == block_list_tail)
-    {
+static void
+bin_remove(mem_block_t *curr)
+{
+    unsigned bin = size_to_bin(BLOCK_CAP(curr));
+    free_links_t *links = FREE_LINKS(curr);
 
-        curr->next = NULL;
-        block_list_tail = curr;
+    if (links->prev_free != NULL)
+    {
+        FREE_LINKS(links->prev_free)->next_free = links->next_free;
+    }
+    else
+    {
+        heap->bins[bin] = links->next_free;
+    }
+    if (links->next_free != NULL)
+    {
+        FREE_LINKS(links->next_free)->prev_free = links->prev_free;
+    }
+    if (heap->bins[bin] == NULL)
+    {
+        heap->bin_map[bin / BIN_MAP_BITS] &= ~(((uint64_t) 1) << (bin % BIN_MAP_BITS));
     }
-
-    return;
 }
 
-void vikfree(void *ptr)
+// Find a free block with at least size bytes of capacity.
+// Only the bin the size maps into needs to be searched, any block in
+//   a larger bin is guaranteed to fit, so the first non-empty one is
+//   located through bin_map.
+static mem_block_t *
+bin_find(size_t size)
 {
+    unsigned bin = size_to_bin(size);
+    unsigned word = 0;
+    uint64_t bits = 0;
     mem_block_t *curr = NULL;
 
-    if (ptr == NULL)
-        return;
-    else
+    for (curr = heap->bins[bin]; curr != NULL; curr = FREE_LINKS(curr)->next_free)
     {
-        curr = DATA_BLOCK(ptr);
-
-        if (!IS_FREE(curr))
-            curr->size = 0;
-        else 
+        if (BLOCK_CAP(curr) >= size)
         {
-            if (isVerbose) {
-                fprintf(vikalloc_log_stream, "Block is already free: ptr = " PTR "\n"
-                        , (long) (ptr - low_water_mark));
-            }
-            return;
+            return curr;
         }
+    }
 
-        if (curr->next != NULL)
+    bin++;
+    for (word = bin / BIN_MAP_BITS; word < BIN_MAP_WORDS; word++)
+    {
+        bits = heap->bin_map[word];
+        if (word == bin / BIN_MAP_BITS && (bin % BIN_MAP_BITS) != 0)
         {
-            if (IS_FREE(curr->next))
-                coalesce(curr);
+            // ignore the bins below the one we start in
+            bits &= ~((((uint64_t) 1) << (bin % BIN_MAP_BITS)) - 1);
         }
-
-        if (curr->prev != NULL)
+        if (bits != 0)
         {
-            if (IS_FREE(curr->prev))
-                coalesce(curr->prev);
+            return heap->bins[word * BIN_MAP_BITS + (unsigned) __builtin_ctzll(bits)];
         }
-    
     }
 
-    return;
+    return NULL;
 }
 
-void vikalloc_reset(void)
+// The largest free block is in the highest bin that is not empty,
+//   somewhere in its list.
+static size_t
+bin_largest(void)
 {
-    if (isVerbose)
-    {
-        fprintf(vikalloc_log_stream, ">> %d: %s entry\n", __LINE__, __FUNCTION__);
-    }
+    unsigned word = BIN_MAP_WORDS;
+    unsigned bin = 0;
+    size_t largest = 0;
+    mem_block_t *curr = NULL;
 
-    if (low_water_mark != NULL)
+    while (word-- > 0)
     {
-        if (isVerbose)
+        if (heap->bin_map[word] != 0)
         {
-            fprintf(vikalloc_log_stream, "*** Resetting all vikalloc space ***\n");
+            bin = word * BIN_MAP_BITS + 63 - (unsigned) __builtin_clzll(heap->bin_map[word]);
+            for (curr = heap->bins[bin]; curr != NULL; curr = FREE_LINKS(curr)->next_free)
+            {
+                largest = MAX(largest, BLOCK_CAP(curr));
+            }
+            break;
         }
-        brk(low_water_mark);
-        low_water_mark = high_water_mark = NULL;
-        block_list_head = block_list_tail = NULL;
     }
-}
 
-// not done
+    return largest;
+}
 
-void *
-vikcalloc(size_t nmemb, size_t size)
+// TRUE if block a sorts before block b in the tree.
+static int
+tree_less(mem_block_t *a, mem_block_t *b)
 {
-    void *ptr = NULL;
-
-    // check overflow
-    size_t mem_alc = nmemb * size;
-    ptr = vikalloc(mem_alc);
-    // set all the arr to 0
-    memset(ptr, 0, mem_alc);
-
-    if (isVerbose)
+    if (fit_algorithm == NEXT_FIT)
     {
-        fprintf(vikalloc_log_stream, ">> %d: %s entry\n", __LINE__, __FUNCTION__);
+        return a < b;
     }
+    return BLOCK_CAP(a) < BLOCK_CAP(b)
+        || (BLOCK_CAP(a) == BLOCK_CAP(b) && a < b);
+}
 
-    return ptr;
+// The largest capacity in the subtree under curr, next fit only.
+static size_t
+tree_max_capacity(mem_block_t *curr)
+{
+    return curr != NULL ? FREE_TREE(curr)->max_capacity : 0;
 }
 
-//
-void *
-vikrealloc(void *ptr, size_t size)
+static void
+tree_update(mem_block_t *curr)
+{
+    if (fit_algorithm == NEXT_FIT)
+    {
+        FREE_TREE(curr)->max_capacity = MAX(BLOCK_CAP(curr)
+                                            , MAX(tree_max_capacity(FREE_TREE(curr)->left)
+                                                  , tree_max_capacity(FREE_TREE(curr)->right)));
+    }
+}
+
+// Update the blocks from curr up to the root.
+static void
+tree_update_path(mem_block_t *curr)
+{
+    if (fit_algorithm == NEXT_FIT)
+    {
+        for ( ; curr != NULL; curr = FREE_TREE(curr)->parent)
+        {
+            tree_update(curr);
+        }
+    }
+}
+
+static int
+tree_is_red(mem_block_t *curr)
+{
+    return curr != NULL && FREE_TREE(curr)->red;
+}
+
+// Put v where u is in the tree, u's children are left alone.
+static void
+tree_transplant(mem_block_t *u, mem_block_t *v)
+{
+    mem_block_t *parent = FREE_TREE(u)->parent;
+
+    if (parent == NULL)
+        heap->tree_root = v;
+    else if (FREE_TREE(parent)->left == u)
+        FREE_TREE(parent)->left = v;
+    else
+        FREE_TREE(parent)->right = v;
+
+    if (v != NULL)
+        FREE_TREE(v)->parent = parent;
+}
+
+static void
+tree_rotate_left(mem_block_t *x)
+{
+    mem_block_t *y = FREE_TREE(x)->right;
+
+    FREE_TREE(x)->right = FREE_TREE(y)->left;
+    if (FREE_TREE(y)->left != NULL)
+        FREE_TREE(FREE_TREE(y)->left)->parent = x;
+    tree_transplant(x, y);
+    FREE_TREE(y)->left = x;
+    FREE_TREE(x)->parent = y;
+    tree_update(x);
+    tree_update(y);
+}
+
+static void
+tree_rotate_right(mem_block_t *x)
+{
+    mem_block_t *y = FREE_TREE(x)->left;
+
+    FREE_TREE(x)->left = FREE_TREE(y)->right;
+    if (FREE_TREE(y)->right != NULL)
+        FREE_TREE(FREE_TREE(y)->right)->parent = x;
+    tree_transplant(x, y);
+    FREE_TREE(y)->right = x;
+    FREE_TREE(x)->parent = y;
+    tree_update(x);
+    tree_update(y);
+}
+
+static void
+tree_insert(mem_block_t *curr)
+{
+    mem_block_t *parent = NULL;
+    mem_block_t *node = heap->tree_root;
+    mem_block_t *uncle = NULL;
+
+    while (node != NULL)
+    {
+        parent = node;
+        node = tree_less(curr, node) ? FREE_TREE(node)->left : FREE_TREE(node)->right;
+    }
+    FREE_TREE(curr)->left = FREE_TREE(curr)->right = NULL;
+    FREE_TREE(curr)->parent = parent;
+    FREE_TREE(curr)->red = TRUE;
+    if (heap->tree_max == NULL || tree_less(heap->tree_max, curr))
+        heap->tree_max = curr;
+    if (parent == NULL)
+        heap->tree_root = curr;
+    else if (tree_less(curr, parent))
+        FREE_TREE(parent)->left = curr;
+    else
+        FREE_TREE(parent)->right = curr;
+    tree_update_path(curr);
+
+    // restore the red-black properties
+    while (tree_is_red(parent = FREE_TREE(curr)->parent))
+    {
+        mem_block_t *grand = FREE_TREE(parent)->parent;
+
+        if (parent == FREE_TREE(grand)->left)
+        {
+            uncle = FREE_TREE(grand)->right;
+            if (tree_is_red(uncle))
+            {
+                FREE_TREE(parent)->red = FREE_TREE(uncle)->red = FALSE;
+                FREE_TREE(grand)->red = TRUE;
+                curr = grand;
+                continue;
+            }
+            if (curr == FREE_TREE(parent)->right)
+            {
+                tree_rotate_left(parent);
+                curr = parent;
+                parent = FREE_TREE(curr)->parent;
+            }
+            FREE_TREE(parent)->red = FALSE;
+            FREE_TREE(grand)->red = TRUE;
+            tree_rotate_right(grand);
+        }
+        else
+        {
+            uncle = FREE_TREE(grand)->left;
+            if (tree_is_red(uncle))
+            {
+                FREE_TREE(parent)->red = FREE_TREE(uncle)->red = FALSE;
+                FREE_TREE(grand)->red = TRUE;
+                curr = grand;
+                continue;
+            }
+            if (curr == FREE_TREE(parent)->left)
+            {
+                tree_rotate_right(parent);
+                curr = parent;
+                parent = FREE_TREE(curr)->parent;
+            }
+            FREE_TREE(parent)->red = FALSE;
+            FREE_TREE(grand)->red = TRUE;
+            tree_rotate_left(grand);
+        }
+    }
+    FREE_TREE(heap->tree_root)->red = FALSE;
+}
+
+// The block just before curr in the tree order.
+static mem_block_t *
+tree_prev(mem_block_t *curr)
+{
+    mem_block_t *parent = NULL;
+
+    if (FREE_TREE(curr)->left != NULL)
+    {
+        for (curr = FREE_TREE(curr)->left; FREE_TREE(curr)->right != NULL; curr = FREE_TREE(curr)->right)
+            ;
+        return curr;
+    }
+    for (parent = FREE_TREE(curr)->parent
+             ; parent != NULL && curr == FREE_TREE(parent)->left
+             ; parent = FREE_TREE(parent)->parent)
+    {
+        curr = parent;
+    }
+
+    return parent;
+}
+
+static void
+tree_remove(mem_block_t *curr)
+{
+    mem_block_t *x = NULL;
+    mem_block_t *x_parent = NULL;
+    mem_block_t *y = curr;
+    mem_block_t *w = NULL;
+    uint8_t y_red = FREE_TREE(y)->red;
+
+    if (curr == heap->tree_max)
+        heap->tree_max = tree_prev(curr);
+
+    if (FREE_TREE(curr)->left == NULL)
+    {
+        x = FREE_TREE(curr)->right;
+        x_parent = FREE_TREE(curr)->parent;
+        tree_transplant(curr, x);
+    }
+    else if (FREE_TREE(curr)->right == NULL)
+    {
+        x = FREE_TREE(curr)->left;
+        x_parent = FREE_TREE(curr)->parent;
+        tree_transplant(curr, x);
+    }
+    else
+    {
+        // replace curr with its successor
+        for (y = FREE_TREE(curr)->right; FREE_TREE(y)->left != NULL; y = FREE_TREE(y)->left)
+            ;
+        y_red = FREE_TREE(y)->red;
+        x = FREE_TREE(y)->right;
+        if (FREE_TREE(y)->parent == curr)
+        {
+            x_parent = y;
+        }
+        else
+        {
+            x_parent = FREE_TREE(y)->parent;
+            tree_transplant(y, x);
+            FREE_TREE(y)->right = FREE_TREE(curr)->right;
+            FREE_TREE(FREE_TREE(y)->right)->parent = y;
+        }
+        tree_transplant(curr, y);
+        FREE_TREE(y)->left = FREE_TREE(curr)->left;
+        FREE_TREE(FREE_TREE(y)->left)->parent = y;
+        FREE_TREE(y)->red = FREE_TREE(curr)->red;
+    }
+    // every block that lost curr from under it
+    tree_update_path(x_parent);
+
+    if (y_red)
+        return;
+
+    // a black node went away, restore the red-black properties
+    while (x != heap->tree_root && !tree_is_red(x))
+    {
+        if (x == FREE_TREE(x_parent)->left)
+        {
+            w = FREE_TREE(x_parent)->right;
+            if (tree_is_red(w))
+            {
+                FREE_TREE(w)->red = FALSE;
+                FREE_TREE(x_parent)->red = TRUE;
+                tree_rotate_left(x_parent);
+                w = FREE_TREE(x_parent)->right;
+            }
+            if (!tree_is_red(FREE_TREE(w)->left) && !tree_is_red(FREE_TREE(w)->right))
+            {
+                FREE_TREE(w)->red = TRUE;
+                x = x_parent;
+                x_parent = FREE_TREE(x)->parent;
+                continue;
+            }
+            if (!tree_is_red(FREE_TREE(w)->right))
+            {
+                FREE_TREE(FREE_TREE(w)->left)->red = FALSE;
+                FREE_TREE(w)->red = TRUE;
+                tree_rotate_right(w);
+                w = FREE_TREE(x_parent)->right;
+            }
+            FREE_TREE(w)->red = FREE_TREE(x_parent)->red;
+            FREE_TREE(x_parent)->red = FALSE;
+            FREE_TREE(FREE_TREE(w)->right)->red = FALSE;
+            tree_rotate_left(x_parent);
+        }
+        else
+        {
+            w = FREE_TREE(x_parent)->left;
+            if (tree_is_red(w))
+            {
+                FREE_TREE(w)->red = FALSE;
+                FREE_TREE(x_parent)->red = TRUE;
+                tree_rotate_right(x_parent);
+                w = FREE_TREE(x_parent)->left;
+            }
+            if (!tree_is_red(FREE_TREE(w)->left) && !tree_is_red(FREE_TREE(w)->right))
+            {
+                FREE_TREE(w)->red = TRUE;
+                x = x_parent;
+                x_parent = FREE_TREE(x)->parent;
+                continue;
+            }
+            if (!tree_is_red(FREE_TREE(w)->left))
+            {
+                FREE_TREE(FREE_TREE(w)->right)->red = FALSE;
+                FREE_TREE(w)->red = TRUE;
+                tree_rotate_left(w);
+                w = FREE_TREE(x_parent)->left;
+            }
+            FREE_TREE(w)->red = FREE_TREE(x_parent)->red;
+            FREE_TREE(x_parent)->red = FALSE;
+            FREE_TREE(FREE_TREE(w)->left)->red = FALSE;
+            tree_rotate_right(x_parent);
+        }
+        x = heap->tree_root;
+    }
+    if (x != NULL)
+        FREE_TREE(x)->red = FALSE;
+}
+
+// The best fit is the smallest block that still holds size bytes,
+//   the lowest address wins if several blocks have the same capacity.
+static mem_block_t *
+tree_find_best(size_t size)
+{
+    mem_block_t *node = heap->tree_root;
+    mem_block_t *best = NULL;
+
+    while (node != NULL)
+    {
+        if (BLOCK_CAP(node) >= size)
+        {
+            best = node;
+            node = FREE_TREE(node)->left;
+        }
+        else
+        {
+            node = FREE_TREE(node)->right;
+        }
+    }
+
+    return best;
+}
+
+// The free block with the lowest address at or after from that holds
+//   size bytes. Subtrees without a large enough block are skipped, as are
+//   the ones left of a block before from.
+static mem_block_t *
+tree_find_next(mem_block_t *curr, mem_block_t *from, size_t size)
+{
+    mem_block_t *found = NULL;
+
+    if (tree_max_capacity(curr) < size)
+    {
+        return NULL;
+    }
+    if (curr >= from)
+    {
+        found = tree_find_next(FREE_TREE(curr)->left, from, size);
+        if (found != NULL)
+        {
+            return found;
+        }
+        if (BLOCK_CAP(curr) >= size)
+        {
+            return curr;
+        }
+    }
+
+    return tree_find_next(FREE_TREE(curr)->right, from, size);
+}
+
+// Next fit picks up the search at the last block handed out and wraps
+//   around to the start of the heap. Only the free blocks are looked at,
+//   through the tree ordered by address.
+static mem_block_t *
+next_fit_find(size_t size)
+{
+    mem_block_t *curr = NULL;
+
+    if (heap->prev_fit != NULL)
+    {
+        curr = tree_find_next(heap->tree_root, heap->prev_fit, size);
+    }
+    if (curr == NULL)
+    {
+        curr = tree_find_next(heap->tree_root, NULL, size);
+    }
+
+    return curr;
+}
+
+// The worst fit is the largest free block, which the tree keeps track
+//   of as blocks come and go.
+static mem_block_t *
+tree_find_worst(size_t size)
+{
+    if (heap->tree_max != NULL && BLOCK_CAP(heap->tree_max) >= size)
+    {
+        return heap->tree_max;
+    }
+
+    return NULL;
+}
+
+// The memory below end has been written.
+static void
+heap_dirty(void *end)
+{
+    if (end > heap->clean)
+    {
+        heap->clean = end;
+    }
+}
+
+// The free_* functions hand the work to whichever structure the
+//   current fit algorithm uses to track the free blocks.
+static void
+free_insert(mem_block_t *curr)
+{
+    // the links are written into the block
+    heap_dirty(BLOCK_DATA(curr) + sizeof(free_node_t));
+    heap->free_blocks++;
+    heap->free_bytes += BLOCK_CAP(curr);
+    heap->free_histogram[FRAG_HIST_BIN(BLOCK_CAP(curr))]++;
+    switch (fit_algorithm)
+    {
+    case BEST_FIT:
+    case WORST_FIT:
+    case NEXT_FIT:
+        tree_insert(curr);
+        break;
+    default:
+        bin_insert(curr);
+        break;
+    }
+}
+
+static void
+free_remove(mem_block_t *curr)
+{
+    switch (fit_algorithm)
+    {
+    case BEST_FIT:
+    case WORST_FIT:
+    case NEXT_FIT:
+        tree_remove(curr);
+        break;
+    default:
+        bin_remove(curr);
+        break;
+    }
+    heap->free_blocks--;
+    heap->free_bytes -= BLOCK_CAP(curr);
+    heap->free_histogram[FRAG_HIST_BIN(BLOCK_CAP(curr))]--;
+    // whatever happens to the block next changes its pages
+    SHARED_AND(curr->capacity, ~PURGED);
+}
+
+static mem_block_t *
+free_find(size_t size)
+{
+    switch (fit_algorithm)
+    {
+    case BEST_FIT:
+        return tree_find_best(size);
+    case WORST_FIT:
+        return tree_find_worst(size);
+    case NEXT_FIT:
+        return next_fit_find(size);
+    default:
+        return bin_find(size);
+    }
+}
+
+static void
+free_clear(void)
+{
+    memset(heap->bins, 0, sizeof(heap->bins));
+    memset(heap->bin_map, 0, sizeof(heap->bin_map));
+    heap->tree_root = heap->tree_max = NULL;
+    heap->free_blocks = 0;
+    heap->free_bytes = 0;
+    memset(heap->free_histogram, 0, sizeof(heap->free_histogram));
+}
+
+// Rebuild the free structures from the block list, used when the fit
+//   algorithm changes.
+static void
+free_rebuild(void)
+{
+    mem_block_t *curr = NULL;
+
+    free_clear();
+    if (heap->block_list_head == NULL)
+    {
+        return;
+    }
+    for (curr = heap->block_list_head; curr != EPILOGUE(); curr = NEXT_BLOCK(curr))
+    {
+        if (IS_FREE(curr))
+        {
+            free_insert(curr);
+        }
+    }
+}
+
+// The sizes of the blocks in use change by add - sub bytes. The owner of
+//   a block changes its size without any lock, so the counter is shared.
+static void
+stat_requested(size_t add, size_t sub)
+{
+    size_t now = SHARED_ADD(stats_requested, add - sub);
+    size_t peak = SHARED_LOAD(stats_peak);
+
+#ifdef VIK_THREADS
+    while (now > peak
+           && !__atomic_compare_exchange_n(&stats_peak, &peak, now, TRUE
+                                           , __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+#else // VIK_THREADS
+    if (now > peak)
+    {
+        stats_peak = now;
+    }
+#endif // VIK_THREADS
+}
+
+// Mark curr free: write its footer and tell the next block about it.
+static void
+mark_free(mem_block_t *curr)
+{
+    curr->size = 0;
+    *BLOCK_FOOTER(curr) = BLOCK_CAP(curr);
+    SHARED_OR(NEXT_BLOCK(curr)->capacity, PREV_FREE);
+}
+
+static void
+mark_used(mem_block_t *curr, size_t size)
+{
+    heap_dirty(BLOCK_DATA(curr) + BLOCK_CAP(curr));
+    stat_requested(size, 0);
+    curr->size = size;
+    SHARED_AND(NEXT_BLOCK(curr)->capacity, ~PREV_FREE);
+}
+
+static void
+set_capacity(mem_block_t *curr, size_t capacity)
+{
+    curr->capacity = capacity | (curr->capacity & FLAG_MASK);
+}
+
+// Merge the block physically after curr into curr. Neither block may
+//   be in the free structures when this is called, the caller is
+//   responsible for putting curr back, since its capacity changes.
+static void
+coalesce(mem_block_t *curr)
+{
+    mem_block_t *remove_node = NEXT_BLOCK(curr);
+
+    set_capacity(curr, BLOCK_CAP(curr) + BLOCK_CAP(remove_node) + BLOCK_SIZE);
+    heap->num_blocks--;
+    if (heap->prev_fit == remove_node)
+    {
+        // keep the roving pointer on a block that still exists
+        heap->prev_fit = curr;
+    }
+
+    return;
+}
+
+// Move the break of the arena, like sbrk(). The main arena uses the
+//   real break, the others move through their region.
+static void *
+heap_sbrk(size_t increment)
+{
+#ifdef VIK_THREADS
+    void *old = heap->region_brk;
+
+    if (heap->region != NULL)
+    {
+        if (increment > (size_t) (heap->region + ARENA_RESERVE - old))
+        {
+            return (void *) -1;
+        }
+        heap->region_brk = old + increment;
+        heap->sbrk_calls++;
+        return old;
+    }
+#endif // VIK_THREADS
+    if (increment != 0)
+    {
+        heap->sbrk_calls++;
+    }
+
+    return sbrk(increment);
+}
+
+// Give all the memory of the arena back.
+static void
+heap_release(void)
+{
+#ifdef VIK_THREADS
+    if (heap->region != NULL)
+    {
+        // the region stays reserved, only its pages go back
+        madvise(heap->region, (size_t) (heap->region_brk - heap->region), MADV_DONTNEED);
+        heap->region_brk = heap->region;
+        return;
+    }
+#endif // VIK_THREADS
+    brk(heap->low_water_mark);
+}
+
+// Pull the break of the arena back to end, which must be below it.
+// Returns FALSE if the break cannot be moved, because someone else
+//   moved it past the end of the heap.
+static uint8_t
+heap_shrink(void *end)
+{
+#ifdef VIK_THREADS
+    if (heap->region != NULL)
+    {
+        madvise(end, (size_t) (heap->region_brk - end), MADV_DONTNEED);
+        heap->region_brk = end;
+        heap->sbrk_calls++;
+        return TRUE;
+    }
+#endif // VIK_THREADS
+    if (sbrk(0) != heap->high_water_mark)
+    {
+        return FALSE;
+    }
+    heap->sbrk_calls++;
+
+    return brk(end) == 0;
+}
+
+static size_t
+purge_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (size_t) now.tv_sec * 1000 + (size_t) now.tv_nsec / 1000000;
+}
+
+// The whole pages of a free block that can be given back. The pages with
+//   the header and free links at the front, and the stamp and footer at
+//   the back, are never touched.
+// Returns the number of pages.
+static size_t
+purge_range(mem_block_t *curr, void **start, void **end)
+{
+    *start = (void *) (((size_t) BLOCK_DATA(curr) + sizeof(free_node_t) + PAGE_SIZE - 1)
+                       & ~(PAGE_SIZE - 1));
+    *end = (void *) (((size_t) BLOCK_STAMP(curr)) & ~(PAGE_SIZE - 1));
+
+    return *end > *start ? (size_t) (*end - *start) / PAGE_SIZE : 0;
+}
+
+// Give back the inside pages of curr if it is large and was free'ed at
+//   or before the time before. The block stays where it is, its pages
+//   come back zeroed the next time they are touched.
+// Returns the number of pages given back.
+static size_t
+purge_block(mem_block_t *curr, size_t before)
+{
+    void *start = NULL;
+    void *end = NULL;
+    size_t pages = 0;
+
+    if (BLOCK_CAP(curr) < PURGE_MIN || IS_PURGED(curr) || *BLOCK_STAMP(curr) > before)
+    {
+        return 0;
+    }
+    pages = purge_range(curr, &start, &end);
+    if (pages == 0 || madvise(start, (size_t) (end - start), MADV_DONTNEED) != 0)
+    {
+        return 0;
+    }
+    SHARED_OR(curr->capacity, PURGED);
+
+    return pages;
+}
+
+// The tree is ordered by capacity, the subtree left of a block that is
+//   too small to purge holds only smaller ones. Ordered by address, for
+//   next fit, a subtree is skipped when nothing under it is large enough.
+static size_t
+purge_tree(mem_block_t *curr, size_t before)
+{
+    size_t purged = 0;
+
+    if (curr == NULL)
+    {
+        return 0;
+    }
+    if (fit_algorithm == NEXT_FIT)
+    {
+        if (tree_max_capacity(curr) < PURGE_MIN)
+        {
+            return 0;
+        }
+        return purge_tree(FREE_TREE(curr)->left, before)
+            + purge_block(curr, before)
+            + purge_tree(FREE_TREE(curr)->right, before);
+    }
+    purged += purge_tree(FREE_TREE(curr)->right, before);
+    if (BLOCK_CAP(curr) >= PURGE_MIN)
+    {
+        purged += purge_block(curr, before);
+        purged += purge_tree(FREE_TREE(curr)->left, before);
+    }
+
+    return purged;
+}
+
+// Purge the large free blocks that have been free since before. Only
+//   the bins of large blocks, or the large end of the tree, are looked at.
+// Returns the number of pages given back.
+static size_t
+heap_purge(size_t before)
+{
+    mem_block_t *curr = NULL;
+    unsigned bin = 0;
+    size_t purged = 0;
+
+    switch (fit_algorithm)
+    {
+    case BEST_FIT:
+    case WORST_FIT:
+    case NEXT_FIT:
+        purged = purge_tree(heap->tree_root, before);
+        break;
+    default:
+        for (bin = size_to_bin(PURGE_MIN); bin < NUM_BINS; bin++)
+        {
+            for (curr = heap->bins[bin]; curr != NULL; curr = FREE_LINKS(curr)->next_free)
+            {
+                purged += purge_block(curr, before);
+            }
+        }
+        break;
+    }
+
+    return purged;
+}
+
+// Give the pages of a free block at the end of the heap back to the
+//   system, keeping pad bytes of it for the next requests.
+// Returns the number of bytes given back.
+static size_t
+heap_trim(size_t pad)
+{
+    mem_block_t *tail = NULL;
+    void *end = NULL;
+
+    if (heap->low_water_mark == NULL || !PREV_IS_FREE(EPILOGUE()))
+    {
+        return 0;
+    }
+    tail = PREV_BLOCK(EPILOGUE());
+    // the new end of the heap is on a page boundary, past the epilogue
+    end = BLOCK_DATA(tail) + ALIGN(MAX(pad, MIN_CAPACITY)) + BLOCK_SIZE;
+    end = (void *) (((size_t) end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    if (end >= heap->high_water_mark)
+    {
+        return 0;
+    }
+
+    free_remove(tail);
+    if (!heap_shrink(end))
+    {
+        free_insert(tail);
+        return 0;
+    }
+    pad = (size_t) (heap->high_water_mark - end);
+    SHARED_STORE(heap->high_water_mark, end);
+    set_capacity(tail, (size_t) ((void *) EPILOGUE() - BLOCK_DATA(tail)));
+    EPILOGUE()->capacity = 0;
+    EPILOGUE()->size = BLOCK_SIZE;
+    mark_free(tail);
+    if (BLOCK_CAP(tail) >= PURGE_MIN)
+    {
+        *BLOCK_STAMP(tail) = purge_clock();
+    }
+    free_insert(tail);
+
+    return pad;
+}
+
+// Get more memory from sbrk() and put it at the end of the heap.
+// The new block is free, but it is not placed into the free
+//   structures. If the last block in the heap is free, the new space
+//   is merged into it.
+static mem_block_t *
+grow_heap(size_t size)
+{
+    mem_block_t *new = NULL;
+    void *start = NULL;
+    size_t pad = 0;
+    size_t amount_alc = ALIGN(((size + BLOCK_SIZE + BLOCK_SIZE) / min_sbrk_size + 1)
+                              * min_sbrk_size);
+
+    start = heap_sbrk(0);
+    pad = ALIGN((size_t) start) - (size_t) start;
+    if (heap_sbrk(pad + amount_alc) == (void *) -1)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (heap->low_water_mark == NULL)
+    {
+        // set up low water mark and high water mark
+        SHARED_STORE(heap->low_water_mark, start);
+        heap->block_list_head = new = (mem_block_t *) (start + pad);
+        new->capacity = 0;
+    }
+    else if (start == heap->high_water_mark)
+    {
+        // the old epilogue becomes the header of the new block
+        new = EPILOGUE();
+    }
+    else
+    {
+        // Someone else moved the break since we last grew the heap.
+        // The old epilogue becomes an in-use fence over their memory.
+        new = EPILOGUE();
+        set_capacity(new, (size_t) (start + pad - heap->high_water_mark));
+        new->size = BLOCK_CAP(new);
+        heap->num_blocks++;
+        new = (mem_block_t *) (start + pad);
+        new->capacity = 0;
+    }
+    heap->num_blocks++;
+    SHARED_STORE(heap->high_water_mark, start + pad + amount_alc);
+    // The new memory is all zero, except for the end of a page that was
+    //   already there, which someone may have written before the break
+    //   was moved down.
+    heap->clean = (void *) (((size_t) start + pad + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    set_capacity(new, (size_t) ((void *) EPILOGUE() - BLOCK_DATA(new)));
+    EPILOGUE()->capacity = 0;
+    EPILOGUE()->size = BLOCK_SIZE;
+    mark_free(new);
+
+    if (PREV_IS_FREE(new))
+    {
+        new = PREV_BLOCK(new);
+        free_remove(new);
+        coalesce(new);
+        mark_free(new);
+    }
+    if (BLOCK_CAP(new) >= PURGE_MIN)
+    {
+        *BLOCK_STAMP(new) = purge_clock();
+    }
+
+    return new;
+}
+
+// Trim curr down to size bytes of capacity, the remainder becomes a new
+//   free block right after it, if it is large enough to be useful.
+static void
+split_block(mem_block_t *curr, size_t size)
+{
+    mem_block_t *split_node = NULL;
+
+    if (BLOCK_CAP(curr) < size + BLOCK_SIZE + MIN_CAPACITY)
+    {
+        return;
+    }
+    split_node = (mem_block_t *) (BLOCK_DATA(curr) + size);
+    split_node->capacity = BLOCK_CAP(curr) - size - BLOCK_SIZE;
+    set_capacity(curr, size);
+    heap->num_blocks++;
+
+    mark_free(split_node);
+    free_insert(split_node);
+}
+
+// How far into curr's data a block must start so that its data lands
+//   offset bytes past an align byte boundary. Any room in front must
+//   be big enough to be a block of its own.
+static size_t
+aligned_gap(mem_block_t *curr, size_t align, size_t offset)
+{
+    size_t gap = (align - (((size_t) BLOCK_DATA(curr) - offset) & (align - 1))) & (align - 1);
+
+    if (gap != 0)
+    {
+        while (gap < BLOCK_SIZE + MIN_CAPACITY)
+        {
+            gap += align;
+        }
+    }
+
+    return gap;
+}
+
+// Hand out a block of size bytes whose data starts offset bytes past an
+//   align byte boundary. Any room in front of that spot is split off
+//   into its own free block.
+static mem_block_t *
+alloc_aligned(size_t size, size_t align, size_t offset)
+{
+    mem_block_t *curr = NULL;
+    mem_block_t *aligned = NULL;
+    size_t need = MAX(ALIGN(size), MIN_CAPACITY);
+    size_t gap = 0;
+
+    // The usual fit may already be in the right spot, if it is not, ask
+    //   for enough room that any block will do.
+    curr = free_find(need);
+    if (curr == NULL || BLOCK_CAP(curr) < aligned_gap(curr, align, offset) + need)
+    {
+        curr = free_find(need + align + BLOCK_SIZE + MIN_CAPACITY);
+    }
+    if (curr != NULL)
+    {
+        free_remove(curr);
+    }
+    else
+    {
+        curr = grow_heap(need + align + BLOCK_SIZE + MIN_CAPACITY);
+        if (curr == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    gap = aligned_gap(curr, align, offset);
+    if (gap != 0)
+    {
+        aligned = (mem_block_t *) (BLOCK_DATA(curr) + gap - BLOCK_SIZE);
+        aligned->capacity = BLOCK_CAP(curr) - gap;
+        set_capacity(curr, gap - BLOCK_SIZE);
+        heap->num_blocks++;
+        mark_free(curr);
+        free_insert(curr);
+        curr = aligned;
+    }
+    split_block(curr, need);
+    mark_used(curr, size);
+
+    return curr;
+}
+
+// Find the page map entry for the page addr is in. The interior levels
+//   are created on demand when create is TRUE.
+static slab_t *
+page_map_lookup(void *addr, uint8_t create)
+{
+    size_t page = ((size_t) addr) >> PAGE_SHIFT;
+    size_t root = (page >> (PM_LEAF_BITS + PM_MID_BITS)) & (PM_ROOT_SIZE - 1);
+    size_t mid = (page >> PM_LEAF_BITS) & (PM_MID_SIZE - 1);
+    // Lookups are done without a lock in the thread safe build, and the
+    //   arenas add slabs in parallel, so a level is only published once
+    //   it has been mapped, by whoever gets there first.
+    slab_t **mids = __atomic_load_n(&page_map[root], __ATOMIC_ACQUIRE);
+    slab_t *leaf = NULL;
+    void *map = NULL;
+
+    if (mids == NULL)
+    {
+        if (!create)
+        {
+            return NULL;
+        }
+        map = mmap(NULL, PM_MID_SIZE * sizeof(slab_t *), PROT_READ | PROT_WRITE
+                   , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+        {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&page_map[root], &mids, map, FALSE
+                                        , __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            mids = map;
+        }
+        else
+        {
+            munmap(map, PM_MID_SIZE * sizeof(slab_t *));
+        }
+    }
+    leaf = __atomic_load_n(&mids[mid], __ATOMIC_ACQUIRE);
+    if (leaf == NULL)
+    {
+        if (!create)
+        {
+            return NULL;
+        }
+        map = mmap(NULL, PM_LEAF_SIZE * sizeof(slab_t), PROT_READ | PROT_WRITE
+                   , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+        {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&mids[mid], &leaf, map, FALSE
+                                        , __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            leaf = map;
+        }
+        else
+        {
+            munmap(map, PM_LEAF_SIZE * sizeof(slab_t));
+        }
+    }
+
+    return &leaf[page & (PM_LEAF_SIZE - 1)];
+}
+
+static void
+page_map_clear(void)
+{
+    size_t root = 0;
+    size_t mid = 0;
+
+    for (root = 0; root < PM_ROOT_SIZE; root++)
+    {
+        if (page_map[root] == NULL)
+        {
+            continue;
+        }
+        for (mid = 0; mid < PM_MID_SIZE; mid++)
+        {
+            if (page_map[root][mid] != NULL)
+            {
+                munmap(page_map[root][mid], PM_LEAF_SIZE * sizeof(slab_t));
+            }
+        }
+        munmap(page_map[root], PM_MID_SIZE * sizeof(slab_t *));
+        page_map[root] = NULL;
+    }
+}
+
+// The slab ptr belongs to, or NULL if ptr is an ordinary block.
+static slab_t *
+slab_lookup(void *ptr)
+{
+    slab_t *slab = NULL;
+
+    if (__atomic_load_n(&slab_count, __ATOMIC_RELAXED) == 0)
+    {
+        return NULL;
+    }
+    slab = page_map_lookup(ptr, FALSE);
+    if (slab == NULL || slab->obj_size == 0)
+    {
+        return NULL;
+    }
+
+    return slab;
+}
+
+static void
+slab_link(slab_t *slab, unsigned class)
+{
+    slab->prev = NULL;
+    slab->next = heap->slab_partial[class];
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab;
+    }
+    heap->slab_partial[class] = slab;
+}
+
+static void
+slab_unlink(slab_t *slab, unsigned class)
+{
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        heap->slab_partial[class] = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+// Carve a block that covers exactly one page, header included, out of
+//   the heap and make it a slab. Owning the whole page keeps ordinary
+//   blocks out of it, so the page map entry alone identifies the slab.
+static slab_t *
+slab_create(unsigned class)
+{
+    mem_block_t *curr = alloc_aligned(PAGE_SIZE - BLOCK_SIZE, PAGE_SIZE, BLOCK_SIZE);
+    slab_t *slab = NULL;
+    unsigned i = 0;
+
+    if (curr == NULL)
+    {
+        return NULL;
+    }
+    slab = page_map_lookup(BLOCK_DATA(curr), TRUE);
+    if (slab == NULL)
+    {
+        heap_free(BLOCK_DATA(curr));
+        errno = ENOMEM;
+        return NULL;
+    }
+    // the objects are counted as they are handed out, not the page
+    stat_requested(0, curr->size);
+    slab->obj_size = CLASS_SIZE(class);
+    slab->nobjs = slab->nfree = (PAGE_SIZE - BLOCK_SIZE) / slab->obj_size;
+    slab->hint = 0;
+    slab->page = BLOCK_DATA(curr);
+    // the bits past the last object are marked in use, so they are
+    //   never found free.
+    memset(slab->map, 0xff, sizeof(slab->map));
+    for (i = 0; i < slab->nobjs / SLAB_MAP_BITS; i++)
+    {
+        slab->map[i] = 0;
+    }
+    if (slab->nobjs % SLAB_MAP_BITS != 0)
+    {
+        slab->map[i] = ~((((uint64_t) 1) << (slab->nobjs % SLAB_MAP_BITS)) - 1);
+    }
+    slab_link(slab, class);
+    __atomic_add_fetch(&slab_count, 1, __ATOMIC_RELAXED);
+
+    return slab;
+}
+
+// Give a slab that has no objects in use back to the heap.
+static void
+slab_release(slab_t *slab)
+{
+    void *page = slab->page;
+
+    slab_unlink(slab, SMALL_CLASS(slab->obj_size));
+    slab->obj_size = 0;
+    __atomic_sub_fetch(&slab_count, 1, __ATOMIC_RELAXED);
+    // heap_free() takes the page off the requested bytes again
+    stat_requested(DATA_BLOCK(page)->size, 0);
+    heap_free(page);
+}
+
+static void *
+small_alloc(size_t size)
+{
+    unsigned class = SMALL_CLASS(size);
+    slab_t *slab = heap->slab_partial[class];
+    unsigned word = 0;
+    unsigned bit = 0;
+
+    if (slab == NULL)
+    {
+        slab = slab_create(class);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+    }
+    // find the first zero bit, a partial slab always has one
+    for (word = slab->hint; ~slab->map[word] == 0; word++)
+        ;
+    bit = (unsigned) __builtin_ctzll(~slab->map[word]);
+    slab->map[word] |= ((uint64_t) 1) << bit;
+    slab->hint = word;
+    if (--slab->nfree == 0)
+    {
+        // full slabs are not kept on a list
+        slab_unlink(slab, class);
+    }
+    // the size asked for is not kept anywhere, an object counts as the
+    //   size of its class both ways
+    stat_requested(slab->obj_size, 0);
+
+    return slab->page + (word * SLAB_MAP_BITS + bit) * slab->obj_size;
+}
+
+static void
+small_free(slab_t *slab, void *ptr)
+{
+    size_t offset = (size_t) (ptr - slab->page);
+    unsigned i = (unsigned) (offset / slab->obj_size);
+    uint64_t bit = ((uint64_t) 1) << (i % SLAB_MAP_BITS);
+    unsigned class = SMALL_CLASS(slab->obj_size);
+
+    if ((offset % slab->obj_size) != 0 || (slab->map[i / SLAB_MAP_BITS] & bit) == 0)
+    {
+        if (isVerbose) {
+            fprintf(vikalloc_log_stream, "Block is already free: ptr = " PTR "\n"
+                    , (long) (ptr - heap->low_water_mark));
+        }
+        return;
+    }
+    slab->map[i / SLAB_MAP_BITS] &= ~bit;
+    stat_requested(0, slab->obj_size);
+    if (i / SLAB_MAP_BITS < slab->hint)
+    {
+        slab->hint = (uint16_t) (i / SLAB_MAP_BITS);
+    }
+    if (slab->nfree++ == 0)
+    {
+        slab_link(slab, class);
+    }
+    // An empty slab goes back to the heap, unless it is the last one
+    //   for its class, which saves recreating it on the next request.
+    if (slab->nfree == slab->nobjs
+        && (heap->slab_partial[class] != slab || slab->next != NULL))
+    {
+        slab_release(slab);
+    }
+}
+
+static void
+map_link(map_header_t *map)
+{
+    MAP_LOCK();
+    map->prev = NULL;
+    map->next = map_list;
+    if (map_list != NULL)
+    {
+        map_list->prev = map;
+    }
+    map_list = map;
+    map_count++;
+    map_bytes += MAP_LENGTH(map);
+    map_capacity += BLOCK_CAP(&map->block);
+    MAP_UNLOCK();
+}
+
+static void
+map_unlink(map_header_t *map)
+{
+    MAP_LOCK();
+    if (map->prev != NULL)
+    {
+        map->prev->next = map->next;
+    }
+    else
+    {
+        map_list = map->next;
+    }
+    if (map->next != NULL)
+    {
+        map->next->prev = map->prev;
+    }
+    map_count--;
+    map_bytes -= MAP_LENGTH(map);
+    map_capacity -= BLOCK_CAP(&map->block);
+    MAP_UNLOCK();
+}
+
+// The length of the mapping that holds size bytes lead bytes into it,
+//   or 0 if there is no such length.
+static size_t
+map_length(size_t lead, size_t size)
+{
+    if (lead > SIZE_MAX - PAGE_SIZE || size > SIZE_MAX - PAGE_SIZE - lead)
+    {
+        return 0;
+    }
+
+    return (lead + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+// Serve a large request with a mapping of its own, so its pages go back
+//   to the system as soon as it is free'ed, wherever it sits.
+// The data starts on an align byte boundary. The mapping is made big
+//   enough to slide the data up to one, the pages in front of the header
+//   and past the data are unmapped again.
+static void *
+map_alloc(size_t size, size_t align)
+{
+    map_header_t *map = NULL;
+    void *raw = NULL;
+    void *start = NULL;
+    void *data = NULL;
+    void *end = NULL;
+    size_t total = map_length(ALIGN(sizeof(map_header_t)) + align - ALIGNMENT, size);
+
+    if (total == 0)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    raw = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    data = (void *) (((size_t) raw + sizeof(map_header_t) + align - 1) & ~(align - 1));
+    map = (map_header_t *) (data - sizeof(map_header_t));
+    start = MAP_START(map);
+    end = start + map_length((size_t) (data - start), size);
+    if (start != raw)
+    {
+        munmap(raw, (size_t) (start - raw));
+    }
+    if (end != raw + total)
+    {
+        munmap(end, (size_t) (raw + total - end));
+    }
+    map->magic = MAP_MAGIC;
+    map->block.capacity = (size_t) (end - data) | MAPPED;
+    map->block.size = size;
+    map_link(map);
+    stat_requested(size, 0);
+
+    return data;
+}
+
+static void
+map_free(mem_block_t *curr)
+{
+    map_header_t *map = MAP_HEADER(curr);
+
+    map_unlink(map);
+    stat_requested(0, map->block.size);
+    map->magic = 0;
+    munmap(MAP_START(map), MAP_LENGTH(map));
+}
+
+// TRUE if ptr is in the heap of its arena, which a mapped block never is.
+static int
+heap_contains(void *ptr)
+{
+#ifdef VIK_THREADS
+    arena_t *arena = arena_of(ptr);
+#else // VIK_THREADS
+    arena_t *arena = heap;
+#endif // VIK_THREADS
+
+    return ptr >= SHARED_LOAD(arena->low_water_mark)
+        && ptr < SHARED_LOAD(arena->high_water_mark);
+}
+
+// Free the mapped block of ptr, which lies outside of every heap. A block
+//   free'ed twice was unmapped the first time, so its header is only read
+//   once mincore() has found the page it is in.
+static void
+map_free_ptr(void *ptr)
+{
+    map_header_t *map = MAP_HEADER(DATA_BLOCK(ptr));
+    unsigned char resident = 0;
+
+    if (mincore(MAP_START(map), PAGE_SIZE, &resident) != 0
+        || SHARED_LOAD(map->magic) != MAP_MAGIC)
+    {
+        if (isVerbose) {
+            fprintf(vikalloc_log_stream, "Block is already free: ptr = %p\n", ptr);
+        }
+        return;
+    }
+    map_free(&map->block);
+}
+
+// Resize a mapped block with mremap(). The kernel moves the pages of a
+//   block that has to grow, so nothing is copied, however large it is.
+// A block that shrinks gives back its pages past the new size.
+// A block that moves keeps its place in the page, but an alignment
+//   larger than a page is not kept.
+// Returns the data of the block, which may have moved, or NULL.
+static void *
+map_realloc(mem_block_t *curr, size_t size)
+{
+    map_header_t *map = MAP_HEADER(curr);
+    void *start = MAP_START(map);
+    size_t lead = (size_t) (BLOCK_DATA(curr) - start);
+    size_t old_length = MAP_LENGTH(map);
+    size_t length = map_length(lead, size);
+
+    if (length == 0)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (length != old_length)
+    {
+        // the neighbours in the list point at the header, which may move
+        map_unlink(map);
+        start = mremap(start, old_length, length, MREMAP_MAYMOVE);
+        if (start == MAP_FAILED)
+        {
+            map_link(map);
+            errno = ENOMEM;
+            return NULL;
+        }
+        map = (map_header_t *) (start + lead - sizeof(map_header_t));
+        map->block.capacity = (length - lead) | MAPPED;
+        map_link(map);
+    }
+    stat_requested(size, map->block.size);
+    SHARED_STORE(map->block.size, size);
+
+    return BLOCK_DATA(&map->block);
+}
+
+// Clear the first size bytes of curr, which was just taken out of the
+//   free structures, but not the ones known to be zero already: those
+//   at or above the clean mark, or in the pages a purge gave back
+//   (purged_start to purged_end).
+static void
+block_zero(mem_block_t *curr, size_t size, void *purged_start, void *purged_end)
+{
+    void *data = BLOCK_DATA(curr);
+    void *end = data + size;
+    // the footer of the last block is the only thing written past clean
+    void *zero_start = MAX(heap->clean, data);
+    void *zero_end = MIN(end, (void *) (EPILOGUE()) - 2 * sizeof(size_t));
+
+    if (zero_start >= zero_end)
+    {
+        zero_start = MAX(purged_start, data);
+        zero_end = MIN(purged_end, end);
+    }
+    if (zero_start < zero_end)
+    {
+        memset(data, 0, (size_t) (zero_start - data));
+        memset(zero_end, 0, (size_t) (end - zero_end));
+    }
+    else
+    {
+        memset(data, 0, size);
+    }
+}
+
+// With zero set, the block is cleared as vikcalloc() needs it.
+static void *
+heap_alloc(size_t size, uint8_t zero)
+{
+    mem_block_t *curr = NULL;
+    size_t need = MAX(ALIGN(size), MIN_CAPACITY);
+    void *purged_start = NULL;
+    void *purged_end = NULL;
+    void *ptr = NULL;
+
+    if (small_objects && size <= SMALL_MAX)
+    {
+        ptr = small_alloc(size);
+        if (zero && ptr != NULL)
+        {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+
+    curr = free_find(need);
+    if (curr != NULL)
+    {
+        if (zero && IS_PURGED(curr))
+        {
+            purge_range(curr, &purged_start, &purged_end);
+        }
+        free_remove(curr);
+    }
+    else
+    {
+        // nothing fits, we need to create a new block at the end.
+        curr = grow_heap(need);
+        if (curr == NULL)
+        {
+            return NULL;
+        }
+    }
+    // before the split writes a header past the clean mark
+    if (zero)
+    {
+        block_zero(curr, size, purged_start, purged_end);
+    }
+    split_block(curr, need);
+    mark_used(curr, size);
+    heap->prev_fit = curr;
+
+    return BLOCK_DATA(curr);
+}
+
+// Carve count blocks of size bytes out of one free block, found with a
+//   single search, or out of a single new piece of the heap. Each block
+//   but the last is cut to fit, the last one is split as usual.
+// Only if the heap cannot grow by that much are the blocks allocated
+//   one at a time. Returns the number of blocks placed in ptrs.
+static size_t
+heap_alloc_batch(size_t count, size_t size, void **ptrs)
+{
+    mem_block_t *curr = NULL;
+    mem_block_t *next = NULL;
+    size_t need = MAX(ALIGN(size), MIN_CAPACITY);
+    size_t total = count * (need + BLOCK_SIZE) - BLOCK_SIZE;
+    size_t i = 0;
+
+    curr = free_find(total);
+    if (curr != NULL)
+    {
+        free_remove(curr);
+    }
+    else
+    {
+        curr = grow_heap(total);
+        if (curr == NULL)
+        {
+            for (i = 0; i < count; i++)
+            {
+                if ((ptrs[i] = heap_alloc(size, FALSE)) == NULL)
+                {
+                    break;
+                }
+            }
+            return i;
+        }
+    }
+
+    for (i = 0; i + 1 < count; i++)
+    {
+        next = (mem_block_t *) (BLOCK_DATA(curr) + need);
+        next->capacity = BLOCK_CAP(curr) - need - BLOCK_SIZE;
+        set_capacity(curr, need);
+        heap->num_blocks++;
+        mark_used(curr, size);
+        ptrs[i] = BLOCK_DATA(curr);
+        curr = next;
+    }
+    split_block(curr, need);
+    mark_used(curr, size);
+    heap->prev_fit = curr;
+    ptrs[i] = BLOCK_DATA(curr);
+
+    return count;
+}
+
+// Free an ordinary block, coalescing it with its free neighbours.
+static void
+block_free(mem_block_t *curr)
+{
+    mem_block_t *next = NULL;
+    size_t now = 0;
+
+    // a cached block still counts with its last size
+    stat_requested(0, curr->size & ~CACHED);
+
+    // the physical neighbours are found in O(1) from the boundary tags
+    next = NEXT_BLOCK(curr);
+    if (IS_FREE(next))
+    {
+        free_remove(next);
+        coalesce(curr);
+    }
+
+    if (PREV_IS_FREE(curr))
+    {
+        curr = PREV_BLOCK(curr);
+        free_remove(curr);
+        coalesce(curr);
+    }
+
+    mark_free(curr);
+    free_insert(curr);
+
+    if (BLOCK_CAP(curr) >= PURGE_MIN)
+    {
+        now = purge_clock();
+        *BLOCK_STAMP(curr) = now;
+    }
+
+    // Only a large free tail is trimmed, and half of the threshold is
+    //   kept, so a heap that shrinks and grows a little does not move
+    //   the break back and forth.
+    if (NEXT_BLOCK(curr) == EPILOGUE() && BLOCK_CAP(curr) > trim_threshold)
+    {
+        heap_trim(trim_threshold / 2);
+    }
+    else if (now != 0 && now - heap->purge_time >= purge_decay)
+    {
+        // The blocks free'ed in the last purge_decay ms are likely to be
+        //   used again soon, the older ones give their pages back.
+        heap->purge_time = now;
+        heap_purge(now - purge_decay);
+    }
+}
+
+static void
+heap_free(void *ptr)
+{
+    slab_t *slab = NULL;
+
+    if ((slab = slab_lookup(ptr)) != NULL)
+    {
+        small_free(slab, ptr);
+    }
+    else if (IS_FREE(DATA_BLOCK(ptr)))
+    {
+        if (isVerbose) {
+            fprintf(vikalloc_log_stream, "Block is already free: ptr = " PTR "\n"
+                    , (long) (ptr - heap->low_water_mark));
+        }
+    }
+    else
+    {
+        block_free(DATA_BLOCK(ptr));
+    }
+}
+
+// Give the end of an in-use block back, leaving it capacity bytes. The
+//   end is free'ed like any block, so it joins a free block after it.
+static void
+block_shrink(mem_block_t *curr, size_t capacity)
+{
+    mem_block_t *rest = NULL;
+
+    if (BLOCK_CAP(curr) < capacity + BLOCK_SIZE + MIN_CAPACITY)
+    {
+        return;
+    }
+    rest = (mem_block_t *) (BLOCK_DATA(curr) + capacity);
+    rest->capacity = BLOCK_CAP(curr) - capacity - BLOCK_SIZE;
+    // none of it was asked for
+    rest->size = 0;
+    set_capacity(curr, capacity);
+    heap->num_blocks++;
+    block_free(rest);
+}
+
+// Resize an in-use block without moving it. A larger block takes in
+//   the free block after it, and the heap grows under a block at its
+//   end. Whatever is left over goes back to the heap.
+// Returns FALSE if the block cannot grow where it is.
+static uint8_t
+heap_resize(mem_block_t *curr, size_t size)
+{
+    mem_block_t *next = NEXT_BLOCK(curr);
+    mem_block_t *new = NULL;
+    size_t need = MAX(ALIGN(size), MIN_CAPACITY);
+
+    if (BLOCK_CAP(curr) < size && size >= SHARED_LOAD(mmap_threshold))
+    {
+        // as large as this, the block is better off in a mapping
+        return FALSE;
+    }
+    if (BLOCK_CAP(curr) < need)
+    {
+        if (next == EPILOGUE()
+            || (IS_FREE(next) && NEXT_BLOCK(next) == EPILOGUE()
+                && BLOCK_CAP(curr) + BLOCK_SIZE + BLOCK_CAP(next) < need))
+        {
+            new = grow_heap(need - BLOCK_CAP(curr));
+            if (new == NULL)
+            {
+                return FALSE;
+            }
+            free_insert(new);
+            // unless someone else moved the break, the new space
+            //   is right after the block
+            next = NEXT_BLOCK(curr);
+        }
+        if (!IS_FREE(next) || BLOCK_CAP(curr) + BLOCK_SIZE + BLOCK_CAP(next) < need)
+        {
+            return FALSE;
+        }
+        free_remove(next);
+        coalesce(curr);
+    }
+    // the block stays in use, with a new size
+    stat_requested(0, curr->size);
+    mark_used(curr, size);
+    block_shrink(curr, need);
+
+    return TRUE;
+}
+
+#ifdef VIK_THREADS
+static void
+cache_push(thread_cache_t *cache, unsigned class, void *ptr, uint8_t is_block)
+{
+    CACHE_NEXT(ptr) = cache->head[class];
+    cache->head[class] = ((uintptr_t) ptr) | (is_block ? CACHE_BLOCK : 0);
+    cache->count[class]++;
+}
+
+static void *
+cache_pop(thread_cache_t *cache, unsigned class, uint8_t *is_block)
+{
+    void *ptr = (void *) (cache->head[class] & ~CACHE_BLOCK);
+
+    *is_block = (cache->head[class] & CACHE_BLOCK) != 0;
+    cache->head[class] = CACHE_NEXT(ptr);
+    cache->count[class]--;
+
+    return ptr;
+}
+
+// Give count blocks of a class back to the heap.
+static void
+cache_flush(thread_cache_t *cache, unsigned class, unsigned count)
+{
+    void *ptr = NULL;
+    uint8_t is_block = FALSE;
+    arena_t *locked = NULL;
+
+    while (count-- > 0 && cache->count[class] > 0)
+    {
+        ptr = cache_pop(cache, class, &is_block);
+        // the blocks go back to the arenas they came from, which
+        //   are mostly the same one
+        if (arena_of(ptr) != locked)
+        {
+            if (locked != NULL)
+            {
+                HEAP_UNLOCK();
+            }
+            locked = arena_of(ptr);
+            arena_lock(locked);
+        }
+        if (is_block)
+        {
+            block_free(DATA_BLOCK(ptr));
+        }
+        else
+        {
+            heap_free(ptr);
+        }
+    }
+    if (locked != NULL)
+    {
+        HEAP_UNLOCK();
+    }
+}
+
+static void
+cache_refill(thread_cache_t *cache, unsigned class)
+{
+    uint8_t is_block = FALSE;
+    void *ptr = NULL;
+    unsigned i = 0;
+
+    HEAP_LOCK();
+    // the same test heap_alloc() uses to pick a slab
+    is_block = !small_objects || CLASS_SIZE(class) > SMALL_MAX;
+    for (i = 0; i < CACHE_BATCH; i++)
+    {
+        ptr = heap_alloc(CLASS_SIZE(class), FALSE);
+        if (ptr == NULL)
+        {
+            break;
+        }
+        if (is_block)
+        {
+            DATA_BLOCK(ptr)->size |= CACHED;
+        }
+        cache_push(cache, class, ptr, is_block);
+    }
+    HEAP_UNLOCK();
+}
+
+// Called when a thread exits, its cached blocks go back to the heap.
+static void
+cache_drain(void *arg)
+{
+    thread_cache_t *cache = arg;
+    unsigned class = 0;
+
+    if (cache->generation != __atomic_load_n(&heap_generation, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    for (class = 0; class < NUM_SMALL_CLASSES; class++)
+    {
+        cache_flush(cache, class, cache->count[class]);
+    }
+}
+
+static void
+cache_key_create(void)
+{
+    pthread_key_create(&cache_key, cache_drain);
+}
+
+static thread_cache_t *
+cache_get(void)
+{
+    thread_cache_t *cache = &thread_cache;
+    unsigned long generation = __atomic_load_n(&heap_generation, __ATOMIC_ACQUIRE);
+
+    if (!cache->registered)
+    {
+        pthread_once(&cache_once, cache_key_create);
+        pthread_setspecific(cache_key, cache);
+        cache->registered = TRUE;
+        cache->generation = generation;
+    }
+    if (cache->generation != generation)
+    {
+        // the heap was reset, the cached blocks no longer exist
+        memset(cache->head, 0, sizeof(cache->head));
+        memset(cache->count, 0, sizeof(cache->count));
+        cache->generation = generation;
+    }
+
+    return cache;
+}
+
+static void *
+cache_alloc(size_t size)
+{
+    thread_cache_t *cache = NULL;
+    unsigned class = SMALL_CLASS(size);
+    void *ptr = NULL;
+    uint8_t is_block = FALSE;
+
+    if (!thread_caching || size > CACHE_MAX)
+    {
+        return NULL;
+    }
+    cache = cache_get();
+    if (cache->count[class] == 0)
+    {
+        cache_refill(cache, class);
+        if (cache->count[class] == 0)
+        {
+            return NULL;
+        }
+    }
+    ptr = cache_pop(cache, class, &is_block);
+    if (is_block)
+    {
+        stat_requested(size, DATA_BLOCK(ptr)->size & ~CACHED);
+        SHARED_STORE(DATA_BLOCK(ptr)->size, size);
+    }
+
+    return ptr;
+}
+
+// Returns FALSE when ptr has to go back to the heap instead.
+static int
+cache_free(void *ptr)
+{
+    thread_cache_t *cache = NULL;
+    mem_block_t *curr = NULL;
+    slab_t *slab = NULL;
+    unsigned class = 0;
+
+    if (!thread_caching)
+    {
+        return FALSE;
+    }
+    slab = slab_lookup(ptr);
+    if (slab != NULL)
+    {
+        class = SMALL_CLASS(slab->obj_size);
+    }
+    else
+    {
+        curr = DATA_BLOCK(ptr);
+        if (IS_FREE(curr) || (SHARED_LOAD(curr->size) & CACHED) != 0)
+        {
+            if (isVerbose) {
+                fprintf(vikalloc_log_stream, "Block is already free: ptr = " PTR "\n"
+                        , (long) (ptr - arena_of(ptr)->low_water_mark));
+            }
+            return TRUE;
+        }
+        if (BLOCK_CAP(curr) > CACHE_MAX)
+        {
+            return FALSE;
+        }
+        // the largest class the block can serve
+        class = SMALL_CLASS(BLOCK_CAP(curr));
+        SHARED_OR(curr->size, CACHED);
+    }
+    cache = cache_get();
+    if (cache->count[class] == CACHE_DEPTH)
+    {
+        cache_flush(cache, class, CACHE_BATCH);
+    }
+    cache_push(cache, class, ptr, slab == NULL);
+
+    return TRUE;
+}
+#endif // VIK_THREADS
+
+// vikalloc() without the trace, for the calls built on it.
+static void *
+alloc_any(size_t size)
+{
+    void *ptr = NULL;
+
+    if (size == 0)
+        return NULL;
+
+    if (size >= SHARED_LOAD(mmap_threshold))
+    {
+        ptr = map_alloc(size, ALIGNMENT);
+    }
+    else
+    {
+#ifdef VIK_THREADS
+        ptr = cache_alloc(size);
+        if (ptr != NULL)
+        {
+            return ptr;
+        }
+#endif // VIK_THREADS
+        HEAP_LOCK();
+        ptr = heap_alloc(size, FALSE);
+        HEAP_UNLOCK();
+    }
+
+    if (isVerbose)
+    {
+        fprintf(vikalloc_log_stream, ">> %d: %s entry: size = %lu\n", __LINE__, __FUNCTION__, size);
+    }
+
+    return ptr;
+}
+
+void *
+vikalloc(size_t size)
+{
+    void *ptr = NULL;
+
+    if (size == 0)
+        return NULL;
+
+    ptr = alloc_any(size);
+    TRACE(VIKALLOC_TRACE_ALLOC, ptr, NULL, size);
+
+    return ptr;
+}
+
+static void
+free_any(void *ptr)
+{
+    // the header of a mapped block may be gone already
+    if (!heap_contains(ptr))
+    {
+        map_free_ptr(ptr);
+        return;
+    }
+#ifdef VIK_THREADS
+    if (cache_free(ptr))
+    {
+        return;
+    }
+#endif // VIK_THREADS
+    HEAP_LOCK_PTR(ptr);
+    heap_free(ptr);
+    HEAP_UNLOCK();
+
+    return;
+}
+
+void vikfree(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    TRACE(VIKALLOC_TRACE_FREE, ptr, NULL, 0);
+    free_any(ptr);
+}
+
+// The size tells a block that cannot be a small object, nor be kept in
+//   a thread cache, so the page map is not looked at. With asserts on,
+//   the size of a block in the heap is checked against its header.
+void
+vikfree_sized(void *ptr, size_t size)
+{
+    mem_block_t *curr = NULL;
+
+    if (ptr == NULL)
+        return;
+
+    TRACE(VIKALLOC_TRACE_FREE, ptr, NULL, size);
+    if (!heap_contains(ptr))
+    {
+        map_free_ptr(ptr);
+        return;
+    }
+    curr = DATA_BLOCK(ptr);
+    if (size <= SMALL_MAX)
+    {
+        // free_any tells a block that is free already
+        assert(slab_lookup(ptr) != NULL ? size <= slab_lookup(ptr)->obj_size
+               : IS_FREE(curr) || (SHARED_LOAD(curr->size) & CACHED) != 0
+               || SHARED_LOAD(curr->size) == size);
+        free_any(ptr);
+        return;
+    }
+    HEAP_LOCK_PTR(ptr);
+    if (IS_FREE(curr) || (SHARED_LOAD(curr->size) & CACHED) != 0)
+    {
+        if (isVerbose) {
+            fprintf(vikalloc_log_stream, "Block is already free: ptr = " PTR "\n"
+                    , (long) (ptr - heap->low_water_mark));
+        }
+    }
+    else
+    {
+        assert(slab_lookup(ptr) == NULL && SHARED_LOAD(curr->size) == size);
+        block_free(curr);
+    }
+    HEAP_UNLOCK();
+}
+
+void vikalloc_reset(void)
+{
+    map_header_t *map = NULL;
+    unsigned i = 0;
+    uint8_t reset = FALSE;
+
+    if (isVerbose)
+    {
+        fprintf(vikalloc_log_stream, ">> %d: %s entry\n", __LINE__, __FUNCTION__);
+    }
+
+    HEAP_LOCK_ALL();
+    for (i = 0; i < NUM_ARENAS; i++)
+    {
+        heap = &arenas[i];
+        if (!ARENA_READY(heap) || heap->low_water_mark == NULL)
+        {
+            continue;
+        }
+        if (isVerbose && !reset)
+        {
+            fprintf(vikalloc_log_stream, "*** Resetting all vikalloc space ***\n");
+        }
+        reset = TRUE;
+        heap_release();
+        SHARED_STORE(heap->low_water_mark, NULL);
+        SHARED_STORE(heap->high_water_mark, NULL);
+        heap->block_list_head = NULL;
+        heap->prev_fit = NULL;
+        heap->clean = NULL;
+        heap->num_blocks = 0;
+        heap->sbrk_calls = 0;
+        free_clear();
+        memset(heap->slab_partial, 0, sizeof(heap->slab_partial));
+    }
+    MAP_LOCK();
+    while (map_list != NULL)
+    {
+        map = map_list;
+        map_list = map->next;
+        munmap(MAP_START(map), MAP_LENGTH(map));
+        reset = TRUE;
+    }
+    map_count = map_bytes = map_capacity = 0;
+    MAP_UNLOCK();
+    SHARED_STORE(stats_requested, 0);
+    SHARED_STORE(stats_peak, 0);
+    // the pools were in the heap
+    POOL_LOCK();
+    pool_list = NULL;
+    POOL_UNLOCK();
+    if (reset)
+    {
+        page_map_clear();
+        slab_count = 0;
+#ifdef VIK_THREADS
+        // the blocks in every thread cache went with the heap
+        __atomic_add_fetch(&heap_generation, 1, __ATOMIC_RELEASE);
+#endif // VIK_THREADS
+    }
+    HEAP_UNLOCK_ALL();
+}
+
+size_t
+vikalloc_trim(size_t pad)
+{
+    size_t released = 0;
+    unsigned i = 0;
+
+    HEAP_LOCK_ALL();
+    for (i = 0; i < NUM_ARENAS; i++)
+    {
+        heap = &arenas[i];
+        if (ARENA_READY(heap))
+        {
+            released += heap_trim(pad);
+            released += heap_purge(SIZE_MAX) * PAGE_SIZE;
+        }
+    }
+    HEAP_UNLOCK_ALL();
+
+    return released;
+}
+
+// not done
+
+void *
+vikcalloc(size_t nmemb, size_t size)
+{
+    void *ptr = NULL;
+    size_t mem_alc = 0;
+
+    // nmemb * size must fit in a size_t
+    if (size != 0 && nmemb > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    mem_alc = nmemb * size;
+    if (mem_alc == 0)
+    {
+        return NULL;
+    }
+
+    // Only the bytes that may have been written are set to 0. Memory
+    //   fresh from the system is zero already.
+    if (mem_alc >= SHARED_LOAD(mmap_threshold))
+    {
+        ptr = map_alloc(mem_alc, ALIGNMENT);
+    }
+    else
+    {
+#ifdef VIK_THREADS
+        ptr = cache_alloc(mem_alc);
+        if (ptr != NULL)
+        {
+            memset(ptr, 0, mem_alc);
+        }
+#endif // VIK_THREADS
+        if (ptr == NULL)
+        {
+            HEAP_LOCK();
+            ptr = heap_alloc(mem_alc, TRUE);
+            HEAP_UNLOCK();
+        }
+    }
+
+    if (isVerbose)
+    {
+        fprintf(vikalloc_log_stream, ">> %d: %s entry\n", __LINE__, __FUNCTION__);
+    }
+    TRACE(VIKALLOC_TRACE_CALLOC, ptr, NULL, mem_alc);
+
+    return ptr;
+}
+
+//
+static void *
+realloc_any(void *ptr, size_t size)
 {
     mem_block_t *curr = NULL;
     void * new_block = NULL;
+    slab_t *slab = NULL;
+    uint8_t resized = FALSE;
     curr = DATA_BLOCK(ptr);
 
-    // If ptr  is NULL,  then  the  call  is equivalent to malloc(size)
-    if (!ptr)
-        return vikalloc(size);
+    // If ptr  is NULL,  then  the  call  is equivalent to malloc(size)
+    if (!ptr)
+        return alloc_any(size);
+
+    // if size is equal to zero, and ptr is not NULL, then the call is equivalent to free(ptr).
+    if (ptr && size == 0)
+    {
+        free_any(ptr);
+        return NULL;
+    }
+    // small objects have no header, their capacity is the size class
+    if ((slab = slab_lookup(ptr)) != NULL)
+    {
+        if (size <= slab->obj_size)
+        {
+            return ptr;
+        }
+        new_block = alloc_any(size);
+        if (new_block != NULL)
+        {
+            memcpy(new_block, ptr, slab->obj_size);
+            free_any(ptr);
+        }
+        return new_block;
+    }
+
+    if (IS_MAPPED(curr))
+    {
+        // A mapped block stays mapped unless it shrinks below the
+        //   threshold, it grows and shrinks by whole pages.
+        if (size >= SHARED_LOAD(mmap_threshold))
+        {
+            return map_realloc(curr, size);
+        }
+    }
+    else if (BLOCK_CAP(curr) >= size
+             && BLOCK_CAP(curr) < MAX(ALIGN(size), MIN_CAPACITY) + BLOCK_SIZE + MIN_CAPACITY)
+    {
+        // it fits, and there is too little left over to give back
+        stat_requested(size, curr->size);
+        SHARED_STORE(curr->size, size);
+        return ptr;
+    }
+    else
+    {
+        HEAP_LOCK_PTR(ptr);
+        resized = heap_resize(curr, size);
+        HEAP_UNLOCK();
+        if (resized)
+        {
+            return ptr;
+        }
+    }
+
+    // The block cannot grow where it is. A new block will be allocated,
+    //  the old contents will be copied into the new block, and the old
+    //  block deallocated.
+    new_block = alloc_any(size);
+    if (new_block != NULL)
+    {
+        // only the bytes in use are worth copying
+        memcpy(new_block, ptr, MIN(SHARED_LOAD(curr->size), size));
+        free_any(ptr); // old block deallocated
+    }
+    
+    if (isVerbose)
+    {
+        fprintf(vikalloc_log_stream, ">> %d: %s entry\n", __LINE__, __FUNCTION__);
+    }
+    return new_block;
+}
+
+void *
+vikrealloc(void *ptr, size_t size)
+{
+    void *new_block = realloc_any(ptr, size);
+
+    TRACE(VIKALLOC_TRACE_REALLOC, new_block, ptr, size);
+
+    return new_block;
+}
+
+void *
+vikstrdup(const char *s)
+{
+    void *ptr = NULL;
+
+    if (s != NULL)
+    {
+        ptr = (char *)alloc_any(strlen(s) + 1);
+        TRACE(VIKALLOC_TRACE_STRDUP, ptr, NULL, strlen(s) + 1);
+    }
+
+    if (ptr != NULL)
+    {
+        strcpy(ptr, s);
+    }
+
+    if (isVerbose)
+    {
+        fprintf(vikalloc_log_stream, ">> %d: %s entry\n", __LINE__, __FUNCTION__);
+    }
+
+    return ptr;
+}
+
+size_t
+vikalloc_batch(size_t count, size_t size, void **ptrs)
+{
+    size_t need = MAX(ALIGN(size), MIN_CAPACITY);
+    size_t done = 0;
+
+    if (count == 0 || size == 0)
+    {
+        return 0;
+    }
+
+    if (size >= SHARED_LOAD(mmap_threshold))
+    {
+        // every mapped block gets its own mapping anyway
+        for (done = 0; done < count; done++)
+        {
+            if ((ptrs[done] = map_alloc(size, ALIGNMENT)) == NULL)
+            {
+                break;
+            }
+        }
+        trace_batch(VIKALLOC_TRACE_ALLOC, ptrs, done, size);
+        return done;
+    }
+    if (count > (SIZE_MAX / 2) / (need + BLOCK_SIZE))
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    HEAP_LOCK();
+    if (small_objects && size <= SMALL_MAX)
+    {
+        for (done = 0; done < count; done++)
+        {
+            if ((ptrs[done] = small_alloc(size)) == NULL)
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        done = heap_alloc_batch(count, size, ptrs);
+    }
+    HEAP_UNLOCK();
+    trace_batch(VIKALLOC_TRACE_ALLOC, ptrs, done, size);
 
-    // if size is equal to zero, and ptr is not NULL, then the call is equivalent to free(ptr).
-    if (ptr && size == 0)
+    if (isVerbose)
     {
-        vikfree(ptr);
-        return NULL;
+        fprintf(vikalloc_log_stream, ">> %d: %s entry\n", __LINE__, __FUNCTION__);
+    }
+
+    return done;
+}
+
+static int
+ptr_compare(const void *a, const void *b)
+{
+    size_t pa = (size_t) *(void * const *) a;
+    size_t pb = (size_t) *(void * const *) b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+// The pointers are sorted by address, in the caller's array, so the
+//   blocks that lie next to each other come one after the other. Such
+//   a run is merged into its first block and free'ed as one, it is
+//   coalesced and put in the free structures once. The arena lock is
+//   held for as long as the pointers stay in the same arena.
+void
+vikfree_batch(void **ptrs, size_t count)
+{
+    mem_block_t *curr = NULL;
+    mem_block_t *next = NULL;
+    uint8_t locked = FALSE;
+    size_t i = 0;
+
+    trace_batch(VIKALLOC_TRACE_FREE, ptrs, count, 0);
+    qsort(ptrs, count, sizeof(void *), ptr_compare);
+    for (i = 0; i < count; i++)
+    {
+        // a block free'ed twice is only free'ed once
+        if (ptrs[i] == NULL || (i > 0 && ptrs[i] == ptrs[i - 1]))
+        {
+            continue;
+        }
+        if (!heap_contains(ptrs[i]))
+        {
+            if (locked)
+            {
+                HEAP_UNLOCK();
+                locked = FALSE;
+            }
+            map_free_ptr(ptrs[i]);
+            continue;
+        }
+        if (locked && !HEAP_HAS(ptrs[i]))
+        {
+            HEAP_UNLOCK();
+            locked = FALSE;
+        }
+        if (!locked)
+        {
+            HEAP_LOCK_PTR(ptrs[i]);
+            locked = TRUE;
+        }
+        if (slab_lookup(ptrs[i]) != NULL || IS_FREE(DATA_BLOCK(ptrs[i])))
+        {
+            heap_free(ptrs[i]);
+            continue;
+        }
+
+        curr = DATA_BLOCK(ptrs[i]);
+        // a block in a thread cache was free'ed already, and stays there
+        if ((SHARED_LOAD(curr->size) & CACHED) != 0)
+        {
+            if (isVerbose) {
+                fprintf(vikalloc_log_stream, "Block is already free: ptr = " PTR "\n"
+                        , (long) (ptrs[i] - heap->low_water_mark));
+            }
+            continue;
+        }
+        for (next = NEXT_BLOCK(curr);
+             i + 1 < count && ptrs[i + 1] == BLOCK_DATA(next)
+                 && next != EPILOGUE() && !IS_FREE(next)
+                 && (SHARED_LOAD(next->size) & CACHED) == 0
+                 && slab_lookup(ptrs[i + 1]) == NULL;
+             next = NEXT_BLOCK(curr))
+        {
+            stat_requested(0, next->size);
+            coalesce(curr);
+            i++;
+        }
+        block_free(curr);
     }
-    // If the new size exceeds the capacity of the existing
-    //  block, a new block will be allocated, the old contents will be copied
-    //  into the new block, and the old block deallocated.
-   
-    // if the new size fit in the existing capacity
-    if (curr->capacity >= size)
+    if (locked)
     {
-        curr->size = size;
-        return ptr;
+        HEAP_UNLOCK();
     }
 
-    // What if the size doesn't fit and qualify with all the previous conditions, 
-    // add more block here.
-    new_block = vikalloc(size);
-    memcpy(new_block, ptr, curr->capacity);
-    vikfree(ptr); // old block deallocated
-    
     if (isVerbose)
     {
         fprintf(vikalloc_log_stream, ">> %d: %s entry\n", __LINE__, __FUNCTION__);
     }
-    return new_block;
 }
 
+// Every counter is kept up to date as the heap changes, this only adds
+//   up those of the arenas and of the mapped blocks.
+void
+vikalloc_get_stats(struct vikalloc_stats *stats)
+{
+    unsigned i = 0;
+    size_t headers = 0;
+
+    if (stats == NULL)
+    {
+        return;
+    }
+    memset(stats, 0, sizeof(struct vikalloc_stats));
+
+    HEAP_LOCK_ALL();
+    for (i = 0; i < NUM_ARENAS; i++)
+    {
+        heap = &arenas[i];
+        if (!ARENA_READY(heap) || heap->low_water_mark == NULL)
+        {
+            continue;
+        }
+        // the epilogue has a header too
+        headers = (heap->num_blocks + 1) * BLOCK_SIZE;
+        stats->capacity += (size_t) (heap->high_water_mark - heap->low_water_mark);
+        stats->overhead += headers;
+        stats->bytes_in_use += (size_t) (heap->high_water_mark - (void *) heap->block_list_head)
+            - headers - heap->free_bytes;
+        stats->bytes_free += heap->free_bytes;
+        stats->used_blocks += heap->num_blocks - heap->free_blocks;
+        stats->free_blocks += heap->free_blocks;
+        stats->sbrk_calls += heap->sbrk_calls;
+    }
+    HEAP_UNLOCK_ALL();
+    MAP_LOCK();
+    stats->capacity += map_bytes;
+    stats->overhead += map_bytes - map_capacity;
+    stats->bytes_in_use += map_capacity;
+    stats->used_blocks += map_count;
+    stats->mapped_blocks = map_count;
+    MAP_UNLOCK();
+    stats->bytes_requested = SHARED_LOAD(stats_requested);
+    stats->peak_requested = SHARED_LOAD(stats_peak);
+}
+
+// The free blocks are only looked at in the free structures: the
+//   largest one is at the top of the bins or the tree, the histogram is
+//   kept as blocks go in and out of them.
+void
+vikalloc_get_frag(struct vikalloc_frag *frag)
+{
+    struct vikalloc_stats stats;
+    unsigned i = 0;
+    unsigned bin = 0;
+    size_t largest = 0;
+
+    if (frag == NULL)
+    {
+        return;
+    }
+    memset(frag, 0, sizeof(struct vikalloc_frag));
+    vikalloc_get_stats(&stats);
+
+    HEAP_LOCK_ALL();
+    for (i = 0; i < NUM_ARENAS; i++)
+    {
+        heap = &arenas[i];
+        if (!ARENA_READY(heap) || heap->low_water_mark == NULL)
+        {
+            continue;
+        }
+        if (fit_algorithm == BEST_FIT || fit_algorithm == WORST_FIT)
+        {
+            largest = heap->tree_max != NULL ? BLOCK_CAP(heap->tree_max) : 0;
+        }
+        else if (fit_algorithm == NEXT_FIT)
+        {
+            largest = tree_max_capacity(heap->tree_root);
+        }
+        else
+        {
+            largest = bin_largest();
+        }
+        frag->largest_free = MAX(frag->largest_free, largest);
+        for (bin = 0; bin < FRAG_HIST_BINS; bin++)
+        {
+            frag->histogram[bin] += heap->free_histogram[bin];
+        }
+    }
+    HEAP_UNLOCK_ALL();
+
+    frag->free_bytes = stats.bytes_free;
+    frag->free_blocks = stats.free_blocks;
+    frag->internal = stats.bytes_in_use - stats.bytes_requested;
+    if (stats.bytes_free != 0)
+    {
+        frag->external = 1.0 - (double) frag->largest_free / (double) stats.bytes_free;
+    }
+}
+
+// Every block is ALIGNMENT aligned, the larger alignments move the block
+//   up to the boundary in the heap or in its mapping.
 void *
-vikstrdup(const char *s)
+vikalloc_aligned(size_t alignment, size_t size)
 {
+    mem_block_t *curr = NULL;
     void *ptr = NULL;
 
-    if (s != NULL)
-        ptr = (char *)vikalloc(strlen(s) + 1);
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT)
+    {
+        return vikalloc(size);
+    }
+    if (size == 0)
+    {
+        return NULL;
+    }
+    if (size > SIZE_MAX - alignment - BLOCK_SIZE - MIN_CAPACITY)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    if (ptr != NULL)
+    if (size >= SHARED_LOAD(mmap_threshold))
     {
-        strcpy(ptr, s);
+        ptr = map_alloc(size, alignment);
+    }
+    else
+    {
+        HEAP_LOCK();
+        curr = alloc_aligned(size, alignment, 0);
+        HEAP_UNLOCK();
+        if (curr != NULL)
+        {
+            ptr = BLOCK_DATA(curr);
+        }
     }
+    TRACE(VIKALLOC_TRACE_ALLOC, ptr, NULL, size);
 
     if (isVerbose)
     {
@@ -374,4 +3546,287 @@ vikstrdup(const char *s)
     return ptr;
 }
 
+int
+vik_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr = NULL;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0
+        || alignment % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
+    if (size != 0)
+    {
+        ptr = vikalloc_aligned(alignment, size);
+        if (ptr == NULL)
+        {
+            return ENOMEM;
+        }
+    }
+    *memptr = ptr;
+
+    return 0;
+}
+
+void *
+vik_aligned_alloc(size_t alignment, size_t size)
+{
+    return vikalloc_aligned(alignment, size);
+}
+
+// Get a chunk with room for at least need bytes and bump from it. The
+//   chunks double in size, so a region that is reused settles on one
+//   chunk.
+static void *
+vikarena_grow(vikarena_t *region, size_t need)
+{
+    vikarena_chunk_t *chunk = NULL;
+    size_t size = 0;
+
+    if (need > SIZE_MAX / 2 - ALIGN(sizeof(vikarena_chunk_t)))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = MAX(region->chunk_size, need + ALIGN(sizeof(vikarena_chunk_t)));
+    chunk = vikalloc(size);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->next = region->chunks;
+    region->chunks = chunk;
+    region->ptr = CHUNK_DATA(chunk);
+    region->end = ((void *) chunk) + size;
+    if (region->chunk_size <= SIZE_MAX / 4)
+    {
+        region->chunk_size *= 2;
+    }
+
+    return region->ptr;
+}
+
+vikarena_t *
+vikarena_create(size_t initial)
+{
+    vikarena_t *region = NULL;
+
+    if (initial > SIZE_MAX / 2)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    region = vikalloc(sizeof(vikarena_t));
+    if (region == NULL)
+    {
+        return NULL;
+    }
+    region->chunks = NULL;
+    region->ptr = region->end = NULL;
+    region->chunk_size = ALIGN(MAX(initial, VIKARENA_CHUNK)) + ALIGN(sizeof(vikarena_chunk_t));
+    if (vikarena_grow(region, 0) == NULL)
+    {
+        vikfree(region);
+        return NULL;
+    }
+
+    return region;
+}
+
+void *
+vikarena_alloc(vikarena_t *region, size_t size)
+{
+    void *ptr = NULL;
+    size_t need = 0;
+
+    if (region == NULL || size == 0)
+    {
+        return NULL;
+    }
+    if (size > SIZE_MAX - ALIGNMENT)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    need = ALIGN(size);
+    if (need > (size_t) (region->end - region->ptr)
+        && vikarena_grow(region, need) == NULL)
+    {
+        return NULL;
+    }
+    ptr = region->ptr;
+    region->ptr += need;
+
+    return ptr;
+}
+
+// Only the newest chunk is kept, it is the largest. A region that fits
+//   in it from then on is reset by just moving its pointer back.
+void
+vikarena_reset(vikarena_t *region)
+{
+    vikarena_chunk_t *chunk = NULL;
+
+    if (region == NULL)
+    {
+        return;
+    }
+    while ((chunk = region->chunks->next) != NULL)
+    {
+        region->chunks->next = chunk->next;
+        vikfree(chunk);
+    }
+    region->ptr = CHUNK_DATA(region->chunks);
+}
+
+void
+vikarena_destroy(vikarena_t *region)
+{
+    vikarena_chunk_t *chunk = NULL;
+
+    if (region == NULL)
+    {
+        return;
+    }
+    while ((chunk = region->chunks) != NULL)
+    {
+        region->chunks = chunk->next;
+        vikfree(chunk);
+    }
+    vikfree(region);
+}
+
+// Every object is alignment aligned, since the chunks are and the size
+//   of the objects is a multiple of it.
+vikpool_t *
+vikpool_create(size_t object_size, size_t alignment)
+{
+    vikpool_t *pool = NULL;
+
+    if (alignment == 0)
+    {
+        alignment = ALIGNMENT;
+    }
+    if ((alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    // a free object holds a link
+    alignment = MAX(alignment, sizeof(void *));
+    object_size = MAX(object_size, sizeof(void *));
+    if (object_size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pool = vikalloc(sizeof(vikpool_t));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(vikpool_t));
+    pool->object_size = (object_size + alignment - 1) & ~(alignment - 1);
+    pool->alignment = alignment;
+    pool->chunk_objects = MAX(VIKPOOL_CHUNK / pool->object_size, 1);
+
+    POOL_LOCK();
+    pool->next = pool_list;
+    if (pool_list != NULL)
+    {
+        pool_list->prev = pool;
+    }
+    pool_list = pool;
+    POOL_UNLOCK();
+
+    return pool;
+}
+
+// Objects come off the free list first, the ones free'ed last are the
+//   most likely to be in the cache. Then they are carved from the newest
+//   chunk, a new chunk is only needed when that one is used up.
+void *
+vikpool_alloc(vikpool_t *pool)
+{
+    void *ptr = NULL;
+    void *chunk = NULL;
+    size_t span = 0;
+
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    if (pool->free_list != NULL)
+    {
+        ptr = pool->free_list;
+        pool->free_list = *(void **) ptr;
+    }
+    else
+    {
+        if (pool->carve == pool->carve_end)
+        {
+            span = pool->chunk_objects * pool->object_size;
+            chunk = vikalloc_aligned(pool->alignment, span + sizeof(void *));
+            if (chunk == NULL)
+            {
+                return NULL;
+            }
+            *(void **) (chunk + span) = pool->chunks;
+            pool->chunks = chunk;
+            pool->carve = chunk;
+            pool->carve_end = chunk + span;
+            SHARED_STORE(pool->num_chunks, pool->num_chunks + 1);
+        }
+        ptr = pool->carve;
+        pool->carve += pool->object_size;
+    }
+    SHARED_STORE(pool->in_use, pool->in_use + 1);
+
+    return ptr;
+}
+
+void
+vikpool_free(vikpool_t *pool, void *ptr)
+{
+    if (pool == NULL || ptr == NULL)
+    {
+        return;
+    }
+    *(void **) ptr = pool->free_list;
+    pool->free_list = ptr;
+    SHARED_STORE(pool->in_use, pool->in_use - 1);
+}
+
+void
+vikpool_destroy(vikpool_t *pool)
+{
+    void *chunk = NULL;
+
+    if (pool == NULL)
+    {
+        return;
+    }
+    POOL_LOCK();
+    if (pool->prev != NULL)
+    {
+        pool->prev->next = pool->next;
+    }
+    else
+    {
+        pool_list = pool->next;
+    }
+    if (pool->next != NULL)
+    {
+        pool->next->prev = pool->prev;
+    }
+    POOL_UNLOCK();
+    while ((chunk = pool->chunks) != NULL)
+    {
+        pool->chunks = *(void **) (chunk + pool->chunk_objects * pool->object_size);
+        vikfree(chunk);
+    }
+    vikfree(pool);
+}
+
 #include "vikalloc_dump.c"
@@ -12,6 +12,7 @@
 # include <values.h>
 # include <stdlib.h>
 # include <stdio.h>
+# include <sys/mman.h>
 
 // enable the define below to disable assert.
 //# define NDEBUG
@@ -47,16 +48,47 @@ typedef enum {
 //# define MIN_SBRK_SIZE 4096
 # endif // MIN_SBRK_SIZE
 
+# ifndef MMAP_THRESHOLD
+#  define MMAP_THRESHOLD (128 * 1024)
+# endif // MMAP_THRESHOLD
+
+# ifndef TRIM_THRESHOLD
+#  define TRIM_THRESHOLD (128 * 1024)
+# endif // TRIM_THRESHOLD
+
+# ifndef PURGE_DECAY
+#  define PURGE_DECAY 1000
+# endif // PURGE_DECAY
+
+# ifndef VIKARENA_CHUNK
+#  define VIKARENA_CHUNK 4096
+# endif // VIKARENA_CHUNK
+
+# ifndef VIKPOOL_CHUNK
+#  define VIKPOOL_CHUNK (64 * 1024)
+# endif // VIKPOOL_CHUNK
+
+# ifndef TRACE_RECORDS
+#  define TRACE_RECORDS 1024
+# endif // TRACE_RECORDS
+
+// The clock of trace times. It is read once for each buffer of
+//   TRACE_RECORDS records, or for every record with TRACE_PRECISE.
+# ifndef TRACE_CLOCK
+#  define TRACE_CLOCK CLOCK_MONOTONIC
+# endif // TRACE_CLOCK
+
 # ifndef SILLY_SBRK_SIZE
 #  define SILLY_SBRK_SIZE 128
 # endif // SILLY_SBRK_SIZE
 
+// The header in front of every block. The blocks are found from each
+//   other by their capacity (boundary tags), so in-use blocks carry no
+//   list links. The low bits of capacity hold flags about the block.
+// A block is free when its size is 0.
 typedef struct mem_block_s {
     size_t capacity;
     size_t size;
-
-    struct mem_block_s *prev;
-    struct mem_block_s *next;
 } mem_block_t;
 
 // The basic memory allocator.
@@ -75,8 +107,31 @@ void *vikalloc(size_t size);
 // Blocks must be coalesced, where possible, as they are free'ed.
 void vikfree(void *ptr);
 
+// Like vikfree(), for a caller that knows the size it asked for, or
+//   last resized the block to. For a size over 512 bytes, the small
+//   object limit, the slab and thread cache lookups are skipped, any
+//   other block is free'ed just as vikfree() does it. Unless NDEBUG is
+//   defined, the size is checked against the one the block was given.
+void vikfree_sized(void *ptr, size_t size);
+
+// Allocate count blocks of size bytes each, placed in ptrs. They are
+//   carved one after the other out of a single free block, found with
+//   one search, or out of one new piece of the heap.
+// Returns the number of blocks allocated. If it is less than count,
+//   errno is set to ENOMEM.
+size_t vikalloc_batch(size_t count, size_t size, void **ptrs);
+
+// Free the count blocks in ptrs, any of which may be NULL. ptrs is
+//   sorted by address in place, so the blocks that lie next to each
+//   other are merged and coalesced with their neighbours once. The
+//   caller gets the array back in that order.
+void vikfree_batch(void **ptrs, size_t count);
+
 // This is like the regular calloc() call. See the man page for details.
 // Allocate memory, using vikalloc and set the memory to all zeroes.
+// Memory fresh from the system is zero already and is not set again.
+// If nmemb * size does not fit in a size_t, errno is set to ENOMEM and
+//   NULL is returned.
 void *vikcalloc(size_t nmemb, size_t size);
 
 // This is like the regular realloc() call. See the man page for details.
@@ -94,9 +149,130 @@ void *vikrealloc(void *ptr, size_t size);
 // return a pointer to the allocated memory.
 void *vikstrdup(const char *s);
 
+// Every block from vikalloc() and the calls above starts on a 16 byte
+//   boundary, which is enough for any type, long double and SSE vectors
+//   included.
+// vikalloc_aligned() gives size bytes that start on an alignment byte
+//   boundary, alignment must be a power of 2. The memory is free'ed and
+//   resized as usual, but vikrealloc() does not keep an alignment larger
+//   than 16 bytes when the block moves.
+// If alignment is not a power of 2, errno is set to EINVAL, if the
+//   memory cannot be had, errno is set to ENOMEM. NULL is returned either
+//   way, and for a size of 0.
+void *vikalloc_aligned(size_t alignment, size_t size);
+
+// These are like the regular posix_memalign() and aligned_alloc() calls.
+//   See the man pages for details.
+// vik_posix_memalign() returns EINVAL if alignment is not a power of 2
+//   multiple of sizeof(void *), or ENOMEM, and leaves *memptr alone.
+int vik_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *vik_aligned_alloc(size_t alignment, size_t size);
+
+// The state of the heap, kept up to date as blocks are allocated,
+//   split, coalesced and free'ed, so reading it does not walk the heap.
+//   The counters are 64 bits.
+typedef struct vikalloc_stats {
+    uint64_t bytes_requested; // the sizes asked for by the blocks in use
+    uint64_t bytes_in_use;    // the capacity of the blocks in use
+    uint64_t bytes_free;      // the capacity of the free blocks
+    uint64_t capacity;        // got from the system, heap and mappings
+    uint64_t overhead;        // the headers of the blocks
+    uint64_t used_blocks;     // mapped blocks included
+    uint64_t free_blocks;
+    uint64_t mapped_blocks;
+    uint64_t sbrk_calls;      // that moved the break, up or down
+    uint64_t peak_requested;  // the most bytes_requested has been
+} vikalloc_stats_t;
+
+// Fill in stats for all of the arenas and the mapped blocks.
+// A slab counts as one block in use, whatever objects are in it, and so
+//   does a block held in a thread cache, with the size it had. The bytes
+//   requested count a small object as the size of its class, and leave
+//   the slab page out. The counters start over with vikalloc_reset().
+void vikalloc_get_stats(struct vikalloc_stats *stats);
+
+// How fragmented the heap is, from the free structures and the counters
+//   vikalloc_get_stats() reads, without walking the heap.
+typedef struct vikalloc_frag {
+    uint64_t free_bytes;
+    uint64_t free_blocks;
+    uint64_t largest_free;   // the largest request served without sbrk()
+    // the capacity of the blocks in use that was not asked for, the
+    //   excess in vikalloc_dump2()
+    uint64_t internal;
+    // 1 - largest_free / free_bytes: 0 when all of the free memory is in
+    //   one block, near 1 when it is in many small ones
+    double external;
+    // free blocks by size, entry i counts the blocks of 2^i to
+    //   2^(i + 1) - 1 bytes of capacity
+    uint64_t histogram[64];
+} vikalloc_frag_t;
+
+// Fill in frag for all of the arenas. A request for more than
+//   largest_free bytes grows the heap however many bytes are free, which
+//   a high external index warns of.
+void vikalloc_get_frag(struct vikalloc_frag *frag);
+
 // Output a map of the current state of the heap.
+// The thread safe build has an arena for every few threads, each of
+//   them gets its own map.
 void vikalloc_dump2(long);
 
+// The formats of vikalloc_dump_ex().
+typedef enum {
+    VIKALLOC_DUMP_CSV
+    , VIKALLOC_DUMP_JSON
+    , VIKALLOC_DUMP_BINARY
+} vikalloc_dump_format_t;
+
+// The flags of vikalloc_dump_ex(). With VIKALLOC_DUMP_SUMMARY only the
+//   totals are written, no blocks. VIKALLOC_DUMP_EVERY(n) writes every
+//   nth block only, the totals still cover all of them.
+# define VIKALLOC_DUMP_SUMMARY 0x1
+# define VIKALLOC_DUMP_EVERY(__n) (((unsigned) (__n) & 0xffff) << 16)
+
+// The status of a block in a dump.
+typedef enum {
+    VIKALLOC_BLOCK_FREE
+    , VIKALLOC_BLOCK_USED
+    , VIKALLOC_BLOCK_SLAB
+    , VIKALLOC_BLOCK_CACHED
+    , VIKALLOC_BLOCK_MAPPED
+    , VIKALLOC_BLOCK_END // after the last block of a binary dump
+} vikalloc_block_status_t;
+
+// A binary dump starts with this header, then has a record for every
+//   block and one with the status VIKALLOC_BLOCK_END, then a struct
+//   vikalloc_stats and a struct vikalloc_frag. All in the byte order of
+//   the machine that wrote it.
+typedef struct vikalloc_dump_header {
+    char magic[4];            // "VIKD"
+    uint32_t version;         // 1
+    uint32_t record_size;     // sizeof(struct vikalloc_dump_record)
+    uint32_t flags;
+    uint64_t addr;            // the offsets are from here
+} vikalloc_dump_header_t;
+
+typedef struct vikalloc_dump_record {
+    int64_t offset;           // of the header of the block, from addr
+    uint64_t capacity;
+    uint64_t size;
+    uint32_t arena;
+    uint32_t status;          // a vikalloc_block_status_t
+} vikalloc_dump_record_t;
+
+// Write the blocks of all of the arenas, the mapped blocks and the
+//   totals of vikalloc_get_stats() and vikalloc_get_frag() to stream,
+//   for programs to read. The offsets are from addr, like the addresses
+//   in vikalloc_dump2().
+// CSV has a "block" line for every block, and a "stat" line for every
+//   total, all with the fields of the header line: record, arena,
+//   offset, capacity, size, status, stat and value. JSON is one object
+//   with a "blocks" array and a "stats" object. The output is buffered,
+//   with no formatted printing per block.
+void vikalloc_dump_ex(FILE *stream, long addr, vikalloc_dump_format_t format
+                      , unsigned flags);
+
 // Completely reset your heap back to zero bytes allocated.
 // You are going to like being able to do this.
 // Implementation can be done in as few as 1 line, though
@@ -106,10 +282,13 @@ void vikalloc_dump2(long);
 //   the heap is just __GONE__!!!
 // You should be able to call vikalloc() after calling vikalloc_reset()
 //   to restart building the heap again.
+// All of the arenas are reset, no other thread may be using the heap.
 void vikalloc_reset(void);
 
 // Set the fit algorithm.
 // This should modify a variable that is static to your C module.
+// The free blocks are re-indexed for the new algorithm, so this is
+//   cheapest to call before the heap is built.
 void vikalloc_set_algorithm(vikalloc_fit_algorithm_t);
 
 // Set the verbosity of your vikalloc() code (and related functions).
@@ -119,6 +298,139 @@ void vikalloc_set_verbose(uint8_t);
 // Set the stream into which diagnostic information will be sent.
 void vikalloc_set_log(FILE *);
 
+// The calls a trace records.
+typedef enum {
+    VIKALLOC_TRACE_ALLOC
+    , VIKALLOC_TRACE_FREE
+    , VIKALLOC_TRACE_CALLOC
+    , VIKALLOC_TRACE_REALLOC
+    , VIKALLOC_TRACE_STRDUP
+} vikalloc_trace_op_t;
+
+// A trace starts with this header, followed by the records, in the byte
+//   order of the machine that wrote it.
+typedef struct vikalloc_trace_header {
+    char magic[4];            // "VIKT"
+    uint32_t version;         // 1
+    uint32_t record_size;     // sizeof(struct vikalloc_trace_record)
+    uint32_t clock;           // TRACE_CLOCK, the clock of the times
+} vikalloc_trace_header_t;
+
+// The clock is read for the first record of a buffer only, unless built
+//   with TRACE_PRECISE. The records after it in the buffer get made up
+//   times, one nanosecond apart, so they keep the calls in order but the
+//   time between two calls is wrong.
+typedef struct vikalloc_trace_record {
+    uint64_t time;            // nanoseconds, of TRACE_CLOCK, see above
+    uint64_t ptr;             // returned, or free'ed
+    uint64_t old_ptr;         // passed to vikrealloc()
+    uint64_t size;            // asked for, nmemb * size for vikcalloc()
+    uint32_t thread;          // numbered from 1 as threads start tracing
+    uint32_t op;              // a vikalloc_trace_op_t
+} vikalloc_trace_record_t;
+
+// Record every vikalloc(), vikfree(), vikfree_sized(), vikcalloc(),
+//   vikrealloc() and vikstrdup() into stream, in binary, NULL stops
+//   tracing. vikalloc_aligned() is recorded as a vikalloc(), the batch
+//   calls as one vikalloc() or vikfree() for each block. The records of
+//   each thread are kept in a buffer of TRACE_RECORDS, written when it
+//   fills, when the thread exits and by vikalloc_trace_flush(), so the
+//   records of different threads are interleaved and in order of time
+//   only within a thread.
+// Allocations are timed as they return, frees as they are called.
+//   Allocations of 0 bytes, vikfree(NULL) and a vikcalloc() whose size
+//   overflows are not recorded.
+void vikalloc_set_trace(FILE *stream);
+
+// Write the records the calling thread has buffered and flush the
+//   trace stream.
+void vikalloc_trace_flush(void);
+
 size_t vikalloc_set_min(size_t);
 
+// Requests of at least this many bytes are not put in the heap, each
+//   gets a mapping of its own from mmap(), which vikfree() unmaps right
+//   away. vikrealloc() resizes them with mremap(), which moves their
+//   pages instead of copying them. Pass 0 to just get the current value,
+//   the smallest threshold is a page.
+// Mapped blocks are listed at the end of vikalloc_dump2().
+size_t vikalloc_set_mmap_threshold(size_t);
+
+// When a free block at the end of the heap grows past this many bytes,
+//   vikfree() moves the break back, keeping half of the threshold free
+//   at the end of the heap. Pass 0 to just get the current value, the
+//   smallest threshold is a page.
+size_t vikalloc_set_trim_threshold(size_t);
+
+// Large free blocks inside the heap cannot go back with the break, the
+//   pages between their header and footer are given back with madvise()
+//   instead, once they have been free for this many milliseconds. Pass 0
+//   to just get the current value.
+// The purged pages show up in vikalloc_dump2().
+size_t vikalloc_set_purge_decay(size_t msecs);
+
+// Give the free memory at the end of the heap back to the system,
+//   keeping pad bytes of it, and purge the large free blocks inside the
+//   heap however long they have been free. Every arena is trimmed.
+// Returns the number of bytes given back.
+size_t vikalloc_trim(size_t pad);
+
+// Turn the small object mode on or off.
+// When it is on, requests of up to 512 bytes are served from page sized
+//   slabs of equally sized objects that carry no header. vikfree() and
+//   vikrealloc() tell them apart from ordinary blocks through a page map.
+// Small objects are never split or coalesced, a bitmap in the page map
+//   tracks which ones are in use. A slab goes back to the heap when its
+//   last object is free'ed. Slabs show up in vikalloc_dump2().
+void vikalloc_set_small_objects(uint8_t);
+
+// Turn the per-thread block caches on (the default) or off.
+// Only the thread safe build (compiled with VIK_THREADS) has them. A
+//   thread keeps a few free'ed blocks of up to 512 bytes for itself and
+//   hands them out again without taking the heap lock. Cached blocks
+//   show up in vikalloc_dump2() as cached, they are not coalesced and
+//   so they change where the fit algorithms place blocks.
+// Turning the caches off empties the cache of the calling thread, the
+//   other threads empty theirs when they exit.
+void vikalloc_set_thread_cache(uint8_t);
+
+// A region is a scope for memory that is all free'ed at once, like the
+//   scratch memory of a request. Its memory comes from chunks that are
+//   allocated with vikalloc(), in the heap or in mappings of their own.
+// vikarena_alloc() bumps a pointer through the newest chunk, the objects
+//   carry no header and cannot be passed to vikfree() or vikrealloc().
+//   They are 16 byte aligned.
+// vikarena_reset() free's everything in the region, it keeps the newest
+//   chunk, the largest one, and starts over in it. Once the region fits
+//   in that chunk, a reset only moves the pointer back.
+// vikarena_destroy() gives all of the chunks back, and the region too.
+// A region must not be used by two threads at once.
+typedef struct vikarena_s vikarena_t;
+
+// The first chunk has room for initial bytes, or VIKARENA_CHUNK bytes
+//   if that is more. Each chunk after it is twice as large.
+vikarena_t *vikarena_create(size_t initial);
+void *vikarena_alloc(vikarena_t *region, size_t size);
+void vikarena_reset(vikarena_t *region);
+void vikarena_destroy(vikarena_t *region);
+
+// A pool hands out objects of a single size, like the nodes of a tree.
+//   Its objects are carved from chunks of about VIKPOOL_CHUNK bytes that
+//   are allocated with vikalloc(). A free'ed object goes on the front of
+//   the free list of the pool and is the next one handed out, so both
+//   calls are a few pointer moves, with no search and no coalescing.
+// The object size is rounded up to a multiple of the alignment, a power
+//   of 2, or of 16 bytes when alignment is 0. If alignment is not a power
+//   of 2, errno is set to EINVAL and NULL is returned.
+// Objects must go back to the pool they came from, not to vikfree().
+//   vikpool_destroy() gives all of the chunks back, in use or not.
+// The pools are listed in vikalloc_dump2(). A pool must not be used by
+//   two threads at once.
+typedef struct vikpool_s vikpool_t;
+
+vikpool_t *vikpool_create(size_t object_size, size_t alignment);
+void *vikpool_alloc(vikpool_t *pool);
+void vikpool_free(vikpool_t *pool, void *ptr);
+void vikpool_destroy(vikpool_t *pool);
+
 #endif // __VIKALLOC_H
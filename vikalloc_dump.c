@@ -1,16 +1,23 @@
 // R. Jesse Chaney
 // rchaney@px.edu
 
-void 
-vikalloc_dump2(long addr)
+// The map of the arena the heap pointer is on.
+static void
+arena_dump(long addr)
 {
     mem_block_t *curr = NULL;
+    mem_block_t *prev = NULL;
+    mem_block_t *next = NULL;
     unsigned i = 0;
-    unsigned user_bytes = 0;
-    unsigned capacity_bytes = 0;
-    unsigned block_bytes = 0;
-    unsigned used_blocks = 0;
-    unsigned free_blocks = 0;
+    // 64 bits, a heap can hold more than 4 GB
+    size_t user_bytes = 0;
+    size_t capacity_bytes = 0;
+    size_t block_bytes = 0;
+    size_t used_blocks = 0;
+    size_t free_blocks = 0;
+    size_t purged_pages = 0;
+    void *start = NULL;
+    void *end = NULL;
 
     fprintf(vikalloc_log_stream, "Heap map\n");
     fprintf(vikalloc_log_stream
@@ -29,27 +36,33 @@ vikalloc_dump2(long addr)
             , "excess   "
             , "status   "
         );
-    for (curr = block_list_head, i = 0; curr != NULL; curr = curr->next, i++) {
+    for (curr = heap->block_list_head, i = 0; curr != NULL; prev = curr, curr = next, i++) {
+        next = NEXT_BLOCK(curr);
+        if (next == EPILOGUE()) {
+            next = NULL;
+        }
         fprintf(vikalloc_log_stream
                 , "  %u\t\t"
                   PTR_T PTR_T PTR_T PTR_T
-                  "%9u\t%9u\t"
-                  "%9u\t%9u\t%s\t%c"
+                  "%9lu\t%9lu\t"
+                  "%9lu\t%9lu\t%s\t%c"
                 , i
                 , (long) (((void *) curr) - addr)
-                , (long) (curr->next ? ((void *) curr->next - addr) : 0x0)
-                , (long) (curr->prev ? ((void *) curr->prev - addr) : 0x0)
+                , (long) (next ? ((void *) next - addr) : 0x0)
+                , (long) (prev ? ((void *) prev - addr) : 0x0)
                 , (long) (BLOCK_DATA(curr) - addr)
 
-                , (unsigned) (curr->capacity + BLOCK_SIZE)
-                , (unsigned) curr->capacity
-                , (unsigned) curr->size
-                , (unsigned) (curr->capacity - curr->size)
-                , IS_FREE(curr) ? "free  " : "in use"
+                , (unsigned long) (BLOCK_CAP(curr) + BLOCK_SIZE)
+                , (unsigned long) BLOCK_CAP(curr)
+                , (unsigned long) curr->size
+                , (unsigned long) (BLOCK_CAP(curr) - curr->size)
+                , IS_FREE(curr) ? "free  "
+                  : (slab_lookup(BLOCK_DATA(curr)) ? "slab  "
+                     : ((curr->size & CACHED) ? "cached" : "in use"))
                 , IS_FREE(curr) ? '*' : ' '
             );
         if (NEXT_FIT == fit_algorithm) {
-            if (curr == prev_fit) {
+            if (curr == heap->prev_fit) {
                 fprintf(vikalloc_log_stream, " <");
             }
             else {
@@ -58,11 +71,14 @@ vikalloc_dump2(long addr)
         }
         fprintf(vikalloc_log_stream, "\n");
         user_bytes += curr->size;
-        capacity_bytes += curr->capacity;
-        block_bytes += curr->capacity + BLOCK_SIZE;
+        capacity_bytes += BLOCK_CAP(curr);
+        block_bytes += BLOCK_CAP(curr) + BLOCK_SIZE;
 
         if (IS_FREE(curr)) {
             free_blocks++;
+            if (IS_PURGED(curr)) {
+                purged_pages += purge_range(curr, &start, &end);
+            }
         }
         else {
             used_blocks++;
@@ -70,22 +86,421 @@ vikalloc_dump2(long addr)
     }
     fprintf(vikalloc_log_stream
             , "  %s\t\t\t\t\t\t\t\t"
-              "%u\t\t%u\t\t%u\t\t%u\n"
+              "%lu\t\t%lu\t\t%lu\t\t%lu\n"
             , "Total bytes used"
-            , block_bytes
-            , capacity_bytes
-            , user_bytes
-            , capacity_bytes - user_bytes
+            , (unsigned long) block_bytes
+            , (unsigned long) capacity_bytes
+            , (unsigned long) user_bytes
+            , (unsigned long) (capacity_bytes - user_bytes)
         );
     fprintf(vikalloc_log_stream
-            , "  Used blocks: %4u  Free blocks: %4u  "
+            , "  Used blocks: %4lu  Free blocks: %4lu  "
               "Min heap: " PTR "    Max heap: " PTR 
-              "   Total bytes: %u"
-              "   Block size: %lu bytes\n"
-            , used_blocks, free_blocks
-            , (long) (low_water_mark ? (low_water_mark - addr) : 0x0)
-            , (long) (high_water_mark ? (high_water_mark - addr) : 0x0)
-            , (unsigned) (high_water_mark - low_water_mark)
+              "   Total bytes: %lu"
+              "   Block size: %lu bytes"
+              "   Purged pages: %lu\n"
+            , (unsigned long) used_blocks, (unsigned long) free_blocks
+            , (long) (heap->low_water_mark ? (heap->low_water_mark - addr) : 0x0)
+            , (long) (heap->high_water_mark ? (heap->high_water_mark - addr) : 0x0)
+            , (unsigned long) (heap->high_water_mark - heap->low_water_mark)
             , BLOCK_SIZE
+            , (unsigned long) purged_pages
+        );
+}
+
+// The blocks that have a mapping of their own. They are nowhere near
+//   the heap, so their addresses are shown as they are.
+static void
+map_dump(void)
+{
+    map_header_t *map = NULL;
+    unsigned i = 0;
+
+    fprintf(vikalloc_log_stream, "Mapped blocks\n");
+    fprintf(vikalloc_log_stream
+            , "  %s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n"
+            , "blk no  "
+            , "block add         "
+            , "data add          "
+            , "map size "
+            , "capacity "
+            , "size     "
+            , "excess   "
+            , "status   "
+        );
+    for (map = map_list, i = 0; map != NULL; map = map->next, i++) {
+        fprintf(vikalloc_log_stream
+                , "  %u\t\t%p\t%p\t"
+                  "%9lu\t%9lu\t%9lu\t%9lu\t%s\n"
+                , i
+                , (void *) map
+                , BLOCK_DATA(&map->block)
+                , (unsigned long) MAP_LENGTH(map)
+                , (unsigned long) BLOCK_CAP(&map->block)
+                , (unsigned long) map->block.size
+                , (unsigned long) (BLOCK_CAP(&map->block) - map->block.size)
+                , "mapped"
+            );
+    }
+    fprintf(vikalloc_log_stream
+            , "  Mapped blocks: %4u  Total bytes: %lu   Threshold: %lu bytes\n"
+            , i, (unsigned long) map_bytes, (unsigned long) mmap_threshold
+        );
+}
+
+// The pools, with the objects their chunks hold and how many of them
+//   are in use.
+static void
+pool_dump(void)
+{
+    vikpool_t *pool = NULL;
+    unsigned i = 0;
+    size_t objects = 0;
+    size_t in_use = 0;
+    size_t pool_bytes = 0;
+
+    fprintf(vikalloc_log_stream, "Object pools\n");
+    fprintf(vikalloc_log_stream
+            , "  %s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n"
+            , "pool no "
+            , "pool add          "
+            , "obj size "
+            , "align    "
+            , "chunks   "
+            , "objects  "
+            , "in use   "
+            , "free     "
         );
+    for (pool = pool_list, i = 0; pool != NULL; pool = pool->next, i++) {
+        objects = SHARED_LOAD(pool->num_chunks) * pool->chunk_objects;
+        in_use = SHARED_LOAD(pool->in_use);
+        fprintf(vikalloc_log_stream
+                , "  %u\t\t%p\t"
+                  "%9lu\t%9lu\t%9lu\t%9lu\t%9lu\t%9lu\n"
+                , i
+                , (void *) pool
+                , (unsigned long) pool->object_size
+                , (unsigned long) pool->alignment
+                , (unsigned long) SHARED_LOAD(pool->num_chunks)
+                , (unsigned long) objects
+                , (unsigned long) in_use
+                , (unsigned long) (objects - in_use)
+            );
+        pool_bytes += objects * pool->object_size;
+    }
+    fprintf(vikalloc_log_stream
+            , "  Pools: %4u  Total bytes: %lu   Chunk size: %lu bytes\n"
+            , i, (unsigned long) pool_bytes, (unsigned long) VIKPOOL_CHUNK
+        );
+}
+
+void 
+vikalloc_dump2(long addr)
+{
+    unsigned i = 0;
+
+    HEAP_LOCK_ALL();
+    for (i = 0; i < NUM_ARENAS; i++) {
+        heap = &arenas[i];
+        // the main arena is always shown, the others once they have memory
+        if (i != 0 && (!ARENA_READY(heap) || heap->low_water_mark == NULL)) {
+            continue;
+        }
+        if (i != 0) {
+            fprintf(vikalloc_log_stream, "Arena %u\n", i);
+        }
+        arena_dump(addr);
+    }
+    HEAP_UNLOCK_ALL();
+    MAP_LOCK();
+    if (map_list != NULL) {
+        map_dump();
+    }
+    MAP_UNLOCK();
+    POOL_LOCK();
+    if (pool_list != NULL) {
+        pool_dump();
+    }
+    POOL_UNLOCK();
+}
+
+#define DUMP_BUF_SIZE 16384
+
+// vikalloc_dump_ex() builds its output in buf and writes it out when it
+//   fills up, numbers are formatted by hand.
+typedef struct dump_out_s {
+    FILE *stream;
+    vikalloc_dump_format_t format;
+    // write every nth block, 0 for none
+    unsigned every;
+    size_t seen;
+    size_t written;
+    size_t len;
+    char buf[DUMP_BUF_SIZE];
+} dump_out_t;
+
+static const char *block_status_names[] = {
+    "free", "used", "slab", "cached", "mapped", "end"
+};
+
+static void
+dump_flush(dump_out_t *out)
+{
+    if (out->len > 0) {
+        fwrite(out->buf, 1, out->len, out->stream);
+        out->len = 0;
+    }
+}
+
+static void
+dump_bytes(dump_out_t *out, const void *data, size_t len)
+{
+    if (out->len + len > DUMP_BUF_SIZE) {
+        dump_flush(out);
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+static void
+dump_str(dump_out_t *out, const char *str)
+{
+    dump_bytes(out, str, strlen(str));
+}
+
+static void
+dump_u64(dump_out_t *out, uint64_t value)
+{
+    char digits[20];
+    char text[20];
+    unsigned n = 0;
+    unsigned i = 0;
+
+    do {
+        digits[n++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    for (i = 0; i < n; i++) {
+        text[i] = digits[n - 1 - i];
+    }
+    dump_bytes(out, text, n);
+}
+
+static void
+dump_i64(dump_out_t *out, int64_t value)
+{
+    if (value < 0) {
+        dump_bytes(out, "-", 1);
+        dump_u64(out, -(uint64_t) value);
+    }
+    else {
+        dump_u64(out, (uint64_t) value);
+    }
+}
+
+static void
+dump_block(dump_out_t *out, unsigned arena, int64_t offset, uint64_t capacity
+           , uint64_t size, vikalloc_block_status_t status)
+{
+    vikalloc_dump_record_t record;
+
+    out->seen++;
+    if (out->every == 0 || (out->seen - 1) % out->every != 0) {
+        return;
+    }
+    switch (out->format) {
+    case VIKALLOC_DUMP_BINARY:
+        memset(&record, 0, sizeof(record));
+        record.offset = offset;
+        record.capacity = capacity;
+        record.size = size;
+        record.arena = arena;
+        record.status = status;
+        dump_bytes(out, &record, sizeof(record));
+        break;
+    case VIKALLOC_DUMP_JSON:
+        dump_str(out, out->written > 0 ? ",\n{\"arena\":" : "\n{\"arena\":");
+        dump_u64(out, arena);
+        dump_str(out, ",\"offset\":");
+        dump_i64(out, offset);
+        dump_str(out, ",\"capacity\":");
+        dump_u64(out, capacity);
+        dump_str(out, ",\"size\":");
+        dump_u64(out, size);
+        dump_str(out, ",\"status\":\"");
+        dump_str(out, block_status_names[status]);
+        dump_str(out, "\"}");
+        break;
+    default:
+        dump_str(out, "block,");
+        dump_u64(out, arena);
+        dump_bytes(out, ",", 1);
+        dump_i64(out, offset);
+        dump_bytes(out, ",", 1);
+        dump_u64(out, capacity);
+        dump_bytes(out, ",", 1);
+        dump_u64(out, size);
+        dump_bytes(out, ",", 1);
+        dump_str(out, block_status_names[status]);
+        dump_str(out, ",,\n");
+        break;
+    }
+    out->written++;
+}
+
+// One of the totals, as a CSV line or a JSON member. A CSV total leaves
+//   the fields of a block empty.
+static void
+dump_stat(dump_out_t *out, const char *name, uint64_t value)
+{
+    if (out->format == VIKALLOC_DUMP_JSON) {
+        dump_str(out, out->written > 0 ? ",\"" : "\"");
+        dump_str(out, name);
+        dump_str(out, "\":");
+        dump_u64(out, value);
+    }
+    else {
+        dump_str(out, "stat,,,,,,");
+        dump_str(out, name);
+        dump_bytes(out, ",", 1);
+        dump_u64(out, value);
+        dump_bytes(out, "\n", 1);
+    }
+    out->written++;
+}
+
+static void
+dump_totals(dump_out_t *out, struct vikalloc_stats *stats, struct vikalloc_frag *frag)
+{
+    char text[32];
+    unsigned i = 0;
+
+    out->written = 0;
+    dump_stat(out, "bytes_requested", stats->bytes_requested);
+    dump_stat(out, "bytes_in_use", stats->bytes_in_use);
+    dump_stat(out, "bytes_free", stats->bytes_free);
+    dump_stat(out, "capacity", stats->capacity);
+    dump_stat(out, "overhead", stats->overhead);
+    dump_stat(out, "used_blocks", stats->used_blocks);
+    dump_stat(out, "free_blocks", stats->free_blocks);
+    dump_stat(out, "mapped_blocks", stats->mapped_blocks);
+    dump_stat(out, "sbrk_calls", stats->sbrk_calls);
+    dump_stat(out, "peak_requested", stats->peak_requested);
+    dump_stat(out, "largest_free", frag->largest_free);
+    dump_stat(out, "internal", frag->internal);
+    snprintf(text, sizeof(text), "%.6f", frag->external);
+    if (out->format == VIKALLOC_DUMP_JSON) {
+        dump_str(out, ",\"external\":");
+        dump_str(out, text);
+        dump_str(out, ",\"histogram\":[");
+        for (i = 0; i < 64; i++) {
+            if (i > 0) {
+                dump_bytes(out, ",", 1);
+            }
+            dump_u64(out, frag->histogram[i]);
+        }
+        dump_bytes(out, "]", 1);
+    }
+    else {
+        dump_str(out, "stat,,,,,,external,");
+        dump_str(out, text);
+        dump_bytes(out, "\n", 1);
+        for (i = 0; i < 64; i++) {
+            snprintf(text, sizeof(text), "histogram_%u", i);
+            dump_stat(out, text, frag->histogram[i]);
+        }
+    }
+}
+
+void
+vikalloc_dump_ex(FILE *stream, long addr, vikalloc_dump_format_t format
+                 , unsigned flags)
+{
+    dump_out_t out;
+    vikalloc_dump_header_t header;
+    struct vikalloc_stats stats;
+    struct vikalloc_frag frag;
+    mem_block_t *curr = NULL;
+    map_header_t *map = NULL;
+    vikalloc_block_status_t status = VIKALLOC_BLOCK_FREE;
+    unsigned i = 0;
+
+    if (stream == NULL) {
+        return;
+    }
+    // the totals lock the heap on their own
+    vikalloc_get_stats(&stats);
+    vikalloc_get_frag(&frag);
+
+    out.stream = stream;
+    out.format = format;
+    out.every = (flags & VIKALLOC_DUMP_SUMMARY) ? 0 : MAX(flags >> 16, 1);
+    out.seen = out.written = out.len = 0;
+    if (format == VIKALLOC_DUMP_BINARY) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "VIKD", 4);
+        header.version = 1;
+        header.record_size = sizeof(vikalloc_dump_record_t);
+        header.flags = flags;
+        header.addr = (uint64_t) addr;
+        dump_bytes(&out, &header, sizeof(header));
+    }
+    else if (format == VIKALLOC_DUMP_JSON) {
+        dump_str(&out, "{\"addr\":");
+        dump_u64(&out, (uint64_t) addr);
+        dump_str(&out, ",\"blocks\":[");
+    }
+    else {
+        dump_str(&out, "record,arena,offset,capacity,size,status,stat,value\n");
+    }
+
+    if (out.every != 0) {
+        HEAP_LOCK_ALL();
+        for (i = 0; i < NUM_ARENAS; i++) {
+            heap = &arenas[i];
+            if (!ARENA_READY(heap) || heap->low_water_mark == NULL) {
+                continue;
+            }
+            for (curr = heap->block_list_head; curr != EPILOGUE(); curr = NEXT_BLOCK(curr)) {
+                if (IS_FREE(curr)) {
+                    status = VIKALLOC_BLOCK_FREE;
+                }
+                else if (slab_lookup(BLOCK_DATA(curr)) != NULL) {
+                    status = VIKALLOC_BLOCK_SLAB;
+                }
+                else if (curr->size & CACHED) {
+                    status = VIKALLOC_BLOCK_CACHED;
+                }
+                else {
+                    status = VIKALLOC_BLOCK_USED;
+                }
+                dump_block(&out, i, (int64_t) ((void *) curr - addr), BLOCK_CAP(curr)
+                           , curr->size & ~CACHED, status);
+            }
+        }
+        HEAP_UNLOCK_ALL();
+        MAP_LOCK();
+        for (map = map_list; map != NULL; map = map->next) {
+            dump_block(&out, 0, (int64_t) ((void *) &map->block - addr)
+                       , BLOCK_CAP(&map->block), map->block.size, VIKALLOC_BLOCK_MAPPED);
+        }
+        MAP_UNLOCK();
+    }
+
+    if (format == VIKALLOC_DUMP_BINARY) {
+        out.every = 1;
+        dump_block(&out, 0, 0, 0, 0, VIKALLOC_BLOCK_END);
+        dump_bytes(&out, &stats, sizeof(stats));
+        dump_bytes(&out, &frag, sizeof(frag));
+    }
+    else if (format == VIKALLOC_DUMP_JSON) {
+        dump_str(&out, "\n],\"stats\":{");
+        dump_totals(&out, &stats, &frag);
+        dump_str(&out, "}}\n");
+    }
+    else {
+        dump_totals(&out, &stats, &frag);
+    }
+    dump_flush(&out);
+    fflush(stream);
 }
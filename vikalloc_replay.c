@@ -0,0 +1,636 @@
+// R. Jesse Chaney
+// rchaney@pdx.edu
+
+// Replay an allocation trace against vikalloc() and against the regular
+//   malloc(), and compare how long the calls took, how far each grew the
+//   heap and how fragmented they left it.
+//
+// The trace is either the binary output of vikalloc_set_trace(), or text
+//   with one call per line:
+//     a <id> <size>    allocate size bytes as block id
+//     c <id> <size>    the same, set to zero
+//     r <id> <size>    resize block id, a block that is not allocated
+//                      is allocated, and a size of 0 frees it
+//     f <id>           free block id
+//   Ids are numbers from 0, and are only used again once free'ed.
+//   Anything after a '#' is a comment.
+// In a binary trace the blocks are told apart by their addresses. The
+//   records of all of the threads are replayed by one thread, in order of
+//   time. A free of an address that was not allocated in the trace is
+//   skipped.
+
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <assert.h>
+
+#include <time.h>
+
+#include "vikalloc.h"
+
+#define OPTIONS "ha:s:"
+
+#define FIRST_FIT_STR "ff"
+#define BEST_FIT_STR  "bf"
+#define WORST_FIT_STR "wf"
+#define NEXT_FIT_STR  "nf"
+
+#define NANOSECONDS_PER_SECOND 1000000000.0
+// an id that is not in use
+#define NO_ID UINT32_MAX
+
+typedef enum {
+    OP_ALLOC
+    , OP_CALLOC
+    , OP_REALLOC
+    , OP_FREE
+    , NUM_OPS
+} replay_op_t;
+
+static const char *op_names[NUM_OPS] = {
+    "alloc", "calloc", "realloc", "free"
+};
+
+// One call, on the block in slot id. A realloc moves the block in slot
+//   old_id to slot id.
+typedef struct event_s {
+    uint64_t size;
+    uint32_t id;
+    uint32_t old_id;
+    uint32_t op;
+} event_t;
+
+// The calls of one allocator.
+typedef struct allocator_s {
+    const char *name;
+    void *(*alloc)(size_t);
+    void *(*calloc)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+} allocator_t;
+
+static const allocator_t vikalloc_calls = {
+    "vikalloc", vikalloc, vikcalloc, vikrealloc, vikfree
+};
+static const allocator_t malloc_calls = {
+    "malloc", malloc, calloc, realloc, free
+};
+
+// What a replay measured. The fragmentation is taken at the end of the
+//   trace, with the blocks still in use then.
+typedef struct result_s {
+    size_t peak;
+    uint64_t total;
+    uint64_t wall;
+    struct vikalloc_frag frag;
+    struct mallinfo2 info;
+} result_t;
+
+// The addresses of a binary trace that are in use, and the ids they were
+//   given. Open addressing, with linear probing.
+typedef struct id_entry_s {
+    uint64_t addr;
+    uint32_t id;
+} id_entry_t;
+
+static event_t *events = NULL;
+static size_t num_events = 0;
+static size_t max_events = 0;
+static uint32_t num_slots = 0;
+static size_t skipped = 0;
+static size_t op_count[NUM_OPS] = {0};
+
+static id_entry_t *id_table = NULL;
+static size_t id_table_size = 0;
+
+static vikalloc_trace_record_t *records = NULL;
+
+// the time of each call, grouped by operation
+static uint32_t *latency[NUM_OPS] = {NULL};
+
+void *array_map(size_t count, size_t size);
+void array_unmap(void *array, size_t count, size_t size);
+size_t trace_length(FILE *trace, int binary);
+void add_event(replay_op_t op, uint32_t id, uint32_t old_id, uint64_t size);
+int load_text(FILE *trace);
+int load_binary(FILE *trace);
+int record_compare(const void *a, const void *b);
+uint32_t id_find(uint64_t addr);
+void id_insert(uint64_t addr, uint32_t id);
+void id_remove(uint64_t addr);
+int latency_compare(const void *a, const void *b);
+uint64_t clock_ns(void);
+size_t system_bytes(const allocator_t *calls);
+void replay(const allocator_t *calls, void **slots, result_t *result);
+void report(const allocator_t *calls, result_t *result);
+
+// The arrays of the replay are mapped, not taken from malloc(), which
+//   then starts its replay with next to nothing in its heap.
+void *
+array_map(size_t count, size_t size)
+{
+    void *array = mmap(NULL, MAX(count, 1) * size, PROT_READ | PROT_WRITE
+                       , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (array == MAP_FAILED) {
+        perror("cannot hold the trace");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+void
+array_unmap(void *array, size_t count, size_t size)
+{
+    munmap(array, MAX(count, 1) * size);
+}
+
+// The most events the trace can hold, one per record or line.
+size_t
+trace_length(FILE *trace, int binary)
+{
+    size_t length = 0;
+    int ch = 0;
+
+    if (binary) {
+        fseek(trace, 0, SEEK_END);
+        length = (size_t) ftell(trace);
+        length = length > sizeof(vikalloc_trace_header_t)
+            ? (length - sizeof(vikalloc_trace_header_t)) / sizeof(vikalloc_trace_record_t) : 0;
+    }
+    else {
+        while ((ch = fgetc(trace)) != EOF) {
+            length += ch == '\n';
+        }
+        length++;
+    }
+    rewind(trace);
+
+    return length;
+}
+
+void
+add_event(replay_op_t op, uint32_t id, uint32_t old_id, uint64_t size)
+{
+    assert(num_events < max_events);
+    events[num_events].op = op;
+    events[num_events].id = id;
+    events[num_events].old_id = old_id;
+    events[num_events].size = size;
+    num_events++;
+    op_count[op]++;
+    if (id != NO_ID && id >= num_slots) {
+        num_slots = id + 1;
+    }
+}
+
+int
+load_text(FILE *trace)
+{
+    char line[256];
+    char op = '\0';
+    unsigned long id = 0;
+    unsigned long long size = 0;
+    size_t line_number = 0;
+    int fields = 0;
+
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        line_number++;
+        if (strchr(line, '#') != NULL) {
+            *strchr(line, '#') = '\0';
+        }
+        size = 0;
+        fields = sscanf(line, " %c %lu %llu", &op, &id, &size);
+        if (fields <= 0) {
+            continue;
+        }
+        if (fields < 2 || id >= NO_ID || (op != 'f' && fields < 3)) {
+            fprintf(stderr, "line %lu: cannot read \"%s\"\n", line_number, line);
+            return FALSE;
+        }
+        switch (op) {
+        case 'a':
+            add_event(OP_ALLOC, id, NO_ID, size);
+            break;
+        case 'c':
+            add_event(OP_CALLOC, id, NO_ID, size);
+            break;
+        case 'r':
+            // realloc(ptr, 0) frees the block, as in a binary trace
+            if (size == 0) {
+                add_event(OP_FREE, id, NO_ID, 0);
+            }
+            else {
+                add_event(OP_REALLOC, id, id, size);
+            }
+            break;
+        case 'f':
+            add_event(OP_FREE, id, NO_ID, 0);
+            break;
+        default:
+            fprintf(stderr, "line %lu: unknown call '%c'\n", line_number, op);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// In order of time, the records of a thread stay in the order they
+//   were written.
+int
+record_compare(const void *a, const void *b)
+{
+    const vikalloc_trace_record_t *ra = &records[*(const uint32_t *) a];
+    const vikalloc_trace_record_t *rb = &records[*(const uint32_t *) b];
+
+    if (ra->time != rb->time) {
+        return ra->time < rb->time ? -1 : 1;
+    }
+    return (*(const uint32_t *) a > *(const uint32_t *) b)
+        - (*(const uint32_t *) a < *(const uint32_t *) b);
+}
+
+uint32_t
+id_find(uint64_t addr)
+{
+    size_t i = (addr >> 4) & (id_table_size - 1);
+
+    for ( ; id_table[i].addr != 0; i = (i + 1) & (id_table_size - 1)) {
+        if (id_table[i].addr == addr) {
+            return id_table[i].id;
+        }
+    }
+    return NO_ID;
+}
+
+void
+id_insert(uint64_t addr, uint32_t id)
+{
+    size_t i = (addr >> 4) & (id_table_size - 1);
+
+    while (id_table[i].addr != 0 && id_table[i].addr != addr) {
+        i = (i + 1) & (id_table_size - 1);
+    }
+    id_table[i].addr = addr;
+    id_table[i].id = id;
+}
+
+// The entries after the one removed are put back, so no probe stops
+//   short of them.
+void
+id_remove(uint64_t addr)
+{
+    size_t i = (addr >> 4) & (id_table_size - 1);
+    id_entry_t entry;
+
+    while (id_table[i].addr != addr) {
+        if (id_table[i].addr == 0) {
+            return;
+        }
+        i = (i + 1) & (id_table_size - 1);
+    }
+    id_table[i].addr = 0;
+    for (i = (i + 1) & (id_table_size - 1); id_table[i].addr != 0
+             ; i = (i + 1) & (id_table_size - 1)) {
+        entry = id_table[i];
+        id_table[i].addr = 0;
+        id_insert(entry.addr, entry.id);
+    }
+}
+
+int
+load_binary(FILE *trace)
+{
+    vikalloc_trace_header_t header;
+    vikalloc_trace_record_t *record = NULL;
+    uint32_t *order = NULL;
+    size_t num_records = 0;
+    size_t i = 0;
+    uint32_t id = NO_ID;
+    uint32_t old_id = NO_ID;
+
+    if (fread(&header, sizeof(header), 1, trace) != 1
+        || memcmp(header.magic, "VIKT", 4) != 0 || header.version != 1
+        || header.record_size != sizeof(vikalloc_trace_record_t)) {
+        fprintf(stderr, "not a trace from this version of vikalloc\n");
+        return FALSE;
+    }
+    records = array_map(max_events, sizeof(vikalloc_trace_record_t));
+    num_records = fread(records, sizeof(vikalloc_trace_record_t), max_events, trace);
+    order = array_map(num_records, sizeof(uint32_t));
+    for (id_table_size = 1024; id_table_size < 2 * num_records; id_table_size *= 2)
+        ;
+    id_table = array_map(id_table_size, sizeof(id_entry_t));
+    for (i = 0; i < num_records; i++) {
+        order[i] = i;
+    }
+    qsort(order, num_records, sizeof(uint32_t), record_compare);
+
+    for (i = 0; i < num_records; i++) {
+        record = &records[order[i]];
+        switch (record->op) {
+        case VIKALLOC_TRACE_FREE:
+            id = id_find(record->ptr);
+            if (id == NO_ID) {
+                skipped++;
+                break;
+            }
+            id_remove(record->ptr);
+            add_event(OP_FREE, id, NO_ID, 0);
+            break;
+        case VIKALLOC_TRACE_REALLOC:
+            old_id = record->old_ptr ? id_find(record->old_ptr) : NO_ID;
+            if (record->size == 0) {
+                // a free
+                if (old_id != NO_ID) {
+                    id_remove(record->old_ptr);
+                    add_event(OP_FREE, old_id, NO_ID, 0);
+                }
+                break;
+            }
+            if (record->ptr == 0) {
+                // it failed, the old block stays
+                skipped++;
+                break;
+            }
+            if (old_id != NO_ID) {
+                id_remove(record->old_ptr);
+            }
+            id = num_slots;
+            id_insert(record->ptr, id);
+            if (old_id == NO_ID) {
+                add_event(OP_ALLOC, id, NO_ID, record->size);
+            }
+            else {
+                add_event(OP_REALLOC, id, old_id, record->size);
+            }
+            break;
+        default:
+            if (record->ptr == 0) {
+                skipped++;
+                break;
+            }
+            // the free of this address has not been seen yet, the
+            //   records of two threads crossed
+            if (id_find(record->ptr) != NO_ID) {
+                skipped++;
+            }
+            id = num_slots;
+            id_insert(record->ptr, id);
+            add_event(record->op == VIKALLOC_TRACE_CALLOC ? OP_CALLOC : OP_ALLOC
+                      , id, NO_ID, record->size);
+            break;
+        }
+    }
+    array_unmap(order, num_records, sizeof(uint32_t));
+    array_unmap(records, max_events, sizeof(vikalloc_trace_record_t));
+    array_unmap(id_table, id_table_size, sizeof(id_entry_t));
+    records = NULL;
+    id_table = NULL;
+
+    return TRUE;
+}
+
+int
+latency_compare(const void *a, const void *b)
+{
+    uint32_t la = *(const uint32_t *) a;
+    uint32_t lb = *(const uint32_t *) b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+uint64_t
+clock_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+// What calls has got from the system: the break, the regions mapped for
+//   the arenas of other threads, and the blocks mapped on their own.
+size_t
+system_bytes(const allocator_t *calls)
+{
+    struct vikalloc_stats stats;
+    struct mallinfo2 info;
+
+    if (calls == &malloc_calls) {
+        info = mallinfo2();
+        return info.arena + info.hblkhd;
+    }
+    vikalloc_get_stats(&stats);
+
+    return stats.capacity;
+}
+
+// Replay every event with calls, timing each one, then free what is
+//   left. Nothing else may be allocated until then, malloc() would count
+//   it in its heap, and vikalloc_reset() would take back what others got
+//   from it. Even qsort() may allocate, so the report comes later.
+// malloc() may have a heap already, from loading the trace, which is
+//   counted in its peak.
+void
+replay(const allocator_t *calls, void **slots, result_t *result)
+{
+    size_t count[NUM_OPS] = {0};
+    size_t peak = system_bytes(calls);
+    size_t i = 0;
+    uint64_t t0 = 0;
+    uint64_t t1 = 0;
+    uint64_t total = 0;
+    uint64_t wall = clock_ns();
+    event_t *event = NULL;
+    void *ptr = NULL;
+
+    for (i = 0; i < num_events; i++) {
+        event = &events[i];
+        t0 = clock_ns();
+        switch (event->op) {
+        case OP_ALLOC:
+            slots[event->id] = calls->alloc(event->size);
+            break;
+        case OP_CALLOC:
+            slots[event->id] = calls->calloc(1, event->size);
+            break;
+        case OP_REALLOC:
+            ptr = calls->realloc(slots[event->old_id], event->size);
+            if (ptr != NULL) {
+                slots[event->old_id] = NULL;
+                slots[event->id] = ptr;
+            }
+            break;
+        default:
+            calls->free(slots[event->id]);
+            slots[event->id] = NULL;
+            break;
+        }
+        t1 = clock_ns();
+        latency[event->op][count[event->op]++] = (uint32_t) MIN(t1 - t0, UINT32_MAX);
+        total += t1 - t0;
+        peak = MAX(peak, system_bytes(calls));
+    }
+    result->wall = clock_ns() - wall;
+    result->total = total;
+    result->peak = peak;
+    if (calls == &malloc_calls) {
+        result->info = mallinfo2();
+    }
+    else {
+        vikalloc_get_frag(&result->frag);
+    }
+
+    for (i = 0; i < num_slots; i++) {
+        calls->free(slots[i]);
+        slots[i] = NULL;
+    }
+}
+
+// The times of the calls, the most memory they took and what is left
+//   free with the blocks still in use at the end of the trace.
+void
+report(const allocator_t *calls, result_t *result)
+{
+    size_t n = 0;
+    unsigned op = 0;
+
+    fprintf(stdout, "%s\n", calls->name);
+    fprintf(stdout, "  total time:  %.6lf sec in calls, %.6lf sec replaying\n"
+            , result->total / NANOSECONDS_PER_SECOND, result->wall / NANOSECONDS_PER_SECOND);
+    fprintf(stdout, "  %-8s %10s %8s %8s %8s %8s %8s  (ns)\n"
+            , "", "calls", "p50", "p90", "p99", "p99.9", "max");
+    for (op = 0; op < NUM_OPS; op++) {
+        n = op_count[op];
+        if (n == 0) {
+            continue;
+        }
+        qsort(latency[op], n, sizeof(uint32_t), latency_compare);
+        fprintf(stdout, "  %-8s %10lu %8u %8u %8u %8u %8u\n", op_names[op], n
+                , latency[op][(n - 1) * 500 / 1000], latency[op][(n - 1) * 900 / 1000]
+                , latency[op][(n - 1) * 990 / 1000], latency[op][(n - 1) * 999 / 1000]
+                , latency[op][n - 1]);
+    }
+    fprintf(stdout, "  peak memory: %lu bytes, heap and mappings\n", result->peak);
+    if (calls == &malloc_calls) {
+        fprintf(stdout, "  final frag:  %lu bytes free in %lu chunks, of %lu in the heap\n"
+                , result->info.fordblks, result->info.ordblks, result->info.arena);
+    }
+    else {
+        fprintf(stdout, "  final frag:  %lu bytes free in %lu blocks, largest %lu"
+                ", external %.4lf, internal %lu bytes\n"
+                , result->frag.free_bytes, result->frag.free_blocks, result->frag.largest_free
+                , result->frag.external, result->frag.internal);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE *trace = NULL;
+    char magic[4] = {0};
+    const char *algorithm = "first fit";
+    result_t result;
+    void **slots = NULL;
+    size_t offset = 0;
+    unsigned op = 0;
+    int binary = FALSE;
+    int loaded = FALSE;
+
+    {
+        int opt = -1;
+
+        while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+            switch (opt) {
+            case 'h':
+                fprintf(stdout, "%s [-a ff|bf|wf|nf] [-s #] <trace>\n", argv[0]);
+                fprintf(stdout, "  -h        : print help and exit\n");
+                fprintf(stdout, "  -s #      : set the size of the allocation chunk\n");
+                fprintf(stdout, "  -a <opt>  : algorithm to use for finding room\n");
+                fprintf(stdout, "     ff     : first fit (default)\n");
+                fprintf(stdout, "     bf     : best fit\n");
+                fprintf(stdout, "     wf     : worst fit\n");
+                fprintf(stdout, "     nf     : next fit\n");
+                exit(EXIT_SUCCESS);
+                break;
+            case 'a':
+                if (strcmp(optarg, FIRST_FIT_STR) == 0) {
+                    vikalloc_set_algorithm(FIRST_FIT);
+                    algorithm = "first fit";
+                }
+                else if (strcmp(optarg, BEST_FIT_STR) == 0) {
+                    vikalloc_set_algorithm(BEST_FIT);
+                    algorithm = "best fit";
+                }
+                else if (strcmp(optarg, WORST_FIT_STR) == 0) {
+                    vikalloc_set_algorithm(WORST_FIT);
+                    algorithm = "worst fit";
+                }
+                else if (strcmp(optarg, NEXT_FIT_STR) == 0) {
+                    vikalloc_set_algorithm(NEXT_FIT);
+                    algorithm = "next fit";
+                }
+                else {
+                    fprintf(stderr, "**** Algorithm not recognized %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                vikalloc_set_min(strtol(optarg, NULL, 10));
+                break;
+            default: /* '?' */
+                fprintf(stderr, "%s [-a ff|bf|wf|nf] [-s #] <trace>\n", argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "%s [-a ff|bf|wf|nf] [-s #] <trace>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    trace = fopen(argv[optind], "r");
+    if (trace == NULL) {
+        perror("cannot open trace");
+        exit(EXIT_FAILURE);
+    }
+    binary = fread(magic, sizeof(magic), 1, trace) == 1 && memcmp(magic, "VIKT", 4) == 0;
+    max_events = trace_length(trace, binary);
+    events = array_map(max_events, sizeof(event_t));
+    loaded = binary ? load_binary(trace) : load_text(trace);
+    fclose(trace);
+    if (!loaded) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Everything the replays need is allocated up front, so the break
+    //   only moves for the allocator being replayed.
+    slots = array_map(num_slots, sizeof(void *));
+    latency[0] = array_map(num_events, sizeof(uint32_t));
+    for (op = 0; op < NUM_OPS; op++) {
+        latency[op] = latency[0] + offset;
+        offset += op_count[op];
+    }
+    fprintf(stdout, "trace:         %s, %lu calls on %u blocks, %lu skipped\n"
+            , argv[optind], num_events, num_slots, skipped);
+    fprintf(stdout, "vikalloc with: %s, sbrk() in chunks of %lu\n"
+            , algorithm, vikalloc_set_min(0));
+    fflush(stdout);
+
+    replay(&vikalloc_calls, slots, &result);
+    vikalloc_reset();
+    report(&vikalloc_calls, &result);
+    replay(&malloc_calls, slots, &result);
+    report(&malloc_calls, &result);
+
+    array_unmap(slots, num_slots, sizeof(void *));
+    array_unmap(latency[0], num_events, sizeof(uint32_t));
+    array_unmap(events, max_events, sizeof(event_t));
+
+    return EXIT_SUCCESS;
+}
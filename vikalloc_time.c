@@ -9,6 +9,9 @@
 
 #include <time.h>
 #include <sys/time.h>
+#ifdef VIK_THREADS
+# include <pthread.h>
+#endif // VIK_THREADS
 
 #include "vikalloc.h"
 
@@ -38,6 +41,9 @@
 
 # define vikalloc_dump2(_a)
 # define vikalloc_reset()
+# define vikalloc_set_algorithm(_a)
+# define vikalloc_set_small_objects(_a)
+# define vikalloc_set_trace(_a)
 #endif // REAL_MALLOC
 
 #define TEXT_BLOCK \
@@ -65,6 +71,20 @@ static char *base = NULL;
 void *pointers[NUM_PTRS] = {NULL};
 
 void coalesce1(int testno);
+void workload(int num_ptrs);
+double elapsed(struct timeval *tv0, struct timeval *tv1);
+void fit_compare(int num_ptrs);
+void small_workload(int num_ptrs);
+void small_compare(int num_ptrs);
+double realloc_workload(size_t size);
+void realloc_compare(void);
+double batch_workload(int num_ptrs, int batched);
+void batch_compare(int num_ptrs);
+void trace_compare(int num_ptrs);
+#ifdef VIK_THREADS
+void *thread_workload(void *arg);
+void thread_compare(void);
+#endif // VIK_THREADS
 
 static void init_streams(void) __attribute__((constructor));
 
@@ -109,6 +129,42 @@ main(int argc, char **argv)
     coalesce1(1);
     vikalloc_reset();
 
+    workload(num_ptrs);
+
+    vikalloc_dump2((long) base);
+    vikalloc_reset();
+    coalesce1(2);
+    vikalloc_reset();
+
+    gettimeofday (&tv1, NULL);
+    {
+        double total_time =
+            (((double) (tv1.tv_usec - tv0.tv_usec)) / MICROSECONDS_PER_SECOND)
+            + ((double) (tv1.tv_sec - tv0.tv_sec));
+
+        fprintf(stdout, "array size:  %d\n", num_ptrs);
+        fprintf(stdout, "elapse time: %.4lf\n", total_time);
+    }
+
+#ifndef REAL_MALLOC
+    // these time the knobs and calls malloc does not have, against
+    //   vikalloc itself
+    fit_compare(num_ptrs);
+    small_compare(num_ptrs);
+    realloc_compare();
+    batch_compare(num_ptrs);
+    trace_compare(num_ptrs);
+#endif // REAL_MALLOC
+#ifdef VIK_THREADS
+    thread_compare();
+#endif // VIK_THREADS
+
+    return EXIT_SUCCESS;
+}
+
+void
+workload(int num_ptrs)
+{
     for(int i = 0, j = 1; i < num_ptrs; i++, j = ((j + 1) % 4) + 1) {
         pointers[i] = vikalloc(alloc_chunk_size * j);
     }
@@ -138,24 +194,269 @@ main(int argc, char **argv)
     for(int i = num_ptrs - 3; i >= 0; i -= 3) {
         vikfree(pointers[i]);
     }
-    
-    vikalloc_dump2((long) base);
+}
+
+double
+elapsed(struct timeval *tv0, struct timeval *tv1)
+{
+    return (((double) (tv1->tv_usec - tv0->tv_usec)) / MICROSECONDS_PER_SECOND)
+        + ((double) (tv1->tv_sec - tv0->tv_sec));
+}
+
+// Run the same workload with first fit and with next fit.
+// Next fit starts each search where the last one stopped, instead of
+//   rescanning the crowded front of the heap.
+void
+fit_compare(int num_ptrs)
+{
+    struct timeval tv0;
+    struct timeval tv1;
+
+    vikalloc_set_algorithm(FIRST_FIT);
+    gettimeofday(&tv0, NULL);
+    workload(num_ptrs);
     vikalloc_reset();
-    coalesce1(2);
+    gettimeofday(&tv1, NULL);
+    fprintf(stdout, "first fit:   %.4lf\n", elapsed(&tv0, &tv1));
+
+    vikalloc_set_algorithm(NEXT_FIT);
+    gettimeofday(&tv0, NULL);
+    workload(num_ptrs);
     vikalloc_reset();
+    gettimeofday(&tv1, NULL);
+    fprintf(stdout, "next fit:    %.4lf\n", elapsed(&tv0, &tv1));
 
-    gettimeofday (&tv1, NULL);
-    {
-        double total_time =
-            (((double) (tv1.tv_usec - tv0.tv_usec)) / MICROSECONDS_PER_SECOND)
-            + ((double) (tv1.tv_sec - tv0.tv_sec));
+    vikalloc_set_algorithm(FIRST_FIT);
+}
 
-        fprintf(stdout, "array size:  %d\n", num_ptrs);
-        fprintf(stdout, "elapse time: %.4lf\n", total_time);
+// Lots of objects of 8 to 512 bytes, free'ed in an interleaved order
+//   and allocated again, the way lists and strings come and go.
+void
+small_workload(int num_ptrs)
+{
+    for (int round = 0; round < 50; round++) {
+        for(int i = 0; i < num_ptrs; i++) {
+            pointers[i] = vikalloc(((i * 7) % 64 + 1) * 8);
+        }
+
+        for(int i = 0; i < num_ptrs; i += 2) {
+            vikfree(pointers[i]);
+        }
+
+        for(int i = 0; i < num_ptrs; i += 2) {
+            pointers[i] = vikalloc(((i * 5) % 64 + 1) * 8);
+        }
+
+        for(int i = num_ptrs - 1; i >= 0; i--) {
+            vikfree(pointers[i]);
+        }
     }
+}
 
-    return EXIT_SUCCESS;
+// Run the small object workload through the ordinary blocks and
+//   through the slabs.
+void
+small_compare(int num_ptrs)
+{
+    struct timeval tv0;
+    struct timeval tv1;
+
+    gettimeofday(&tv0, NULL);
+    small_workload(num_ptrs);
+    vikalloc_reset();
+    gettimeofday(&tv1, NULL);
+    fprintf(stdout, "small, off:  %.4lf\n", elapsed(&tv0, &tv1));
+
+    vikalloc_set_small_objects(TRUE);
+    gettimeofday(&tv0, NULL);
+    small_workload(num_ptrs);
+    vikalloc_reset();
+    gettimeofday(&tv1, NULL);
+    fprintf(stdout, "small, on:   %.4lf\n", elapsed(&tv0, &tv1));
+
+    vikalloc_set_small_objects(FALSE);
+}
+
+#define REALLOC_STEPS 64
+#define REALLOC_MAX_MB 64
+
+// Two buffers grow side by side to size bytes, in REALLOC_STEPS steps,
+//   so neither of them can simply grow at the end of the heap.
+// Returns the number of vikrealloc() calls per second.
+double
+realloc_workload(size_t size)
+{
+    struct timeval tv0;
+    struct timeval tv1;
+    char *buf[2] = {NULL, NULL};
+    size_t step = size / REALLOC_STEPS;
+    size_t len = 0;
+    size_t i = 0;
+    int j = 0;
+
+    gettimeofday(&tv0, NULL);
+    for (len = step; len <= size; len += step) {
+        for (j = 0; j < 2; j++) {
+            buf[j] = vikrealloc(buf[j], len);
+            // touch the new pages, as an append would
+            for (i = len - step; i < len; i += 4096) {
+                buf[j][i] = 'a';
+            }
+        }
+    }
+    gettimeofday(&tv1, NULL);
+    vikfree(buf[0]);
+    vikfree(buf[1]);
+    vikalloc_reset();
+
+    return (2.0 * REALLOC_STEPS) / elapsed(&tv0, &tv1);
+}
+
+// Grow buffers of 1 to REALLOC_MAX_MB megabytes in the heap, where
+//   every move copies the buffer, and in mappings, where mremap() moves
+//   the pages without copying them.
+void
+realloc_compare(void)
+{
+    size_t threshold = vikalloc_set_mmap_threshold(0);
+    size_t mb = 0;
+    double heap_rate = 0.0;
+
+    for (mb = 1; mb <= REALLOC_MAX_MB; mb *= 4) {
+        vikalloc_set_mmap_threshold(SIZE_MAX);
+        heap_rate = realloc_workload(mb << 20);
+        vikalloc_set_mmap_threshold(threshold);
+        fprintf(stdout, "realloc %2lu MB  heap: %8.0lf/sec  mapped: %8.0lf/sec\n"
+                , (unsigned long) mb, heap_rate, realloc_workload(mb << 20));
+    }
+}
+
+#define BATCH_SIZE 500
+
+// Allocate and free num_ptrs objects of 64 bytes, BATCH_SIZE at a time,
+//   one call per object or one call per batch. The batch is free'ed in
+//   the order it was allocated, which the batch free sorts again.
+// Returns the number of objects allocated and free'ed per second.
+double
+batch_workload(int num_ptrs, int batched)
+{
+    struct timeval tv0;
+    struct timeval tv1;
+    int round = 0;
+    int i = 0;
+    int j = 0;
+
+    gettimeofday(&tv0, NULL);
+    for (round = 0; round < 20; round++) {
+        for (i = 0; i + BATCH_SIZE <= num_ptrs; i += BATCH_SIZE) {
+            if (batched) {
+                vikalloc_batch(BATCH_SIZE, 64, &pointers[i]);
+            }
+            else {
+                for (j = i; j < i + BATCH_SIZE; j++) {
+                    pointers[j] = vikalloc(64);
+                }
+            }
+        }
+        for (i = 0; i + BATCH_SIZE <= num_ptrs; i += BATCH_SIZE) {
+            if (batched) {
+                vikfree_batch(&pointers[i], BATCH_SIZE);
+            }
+            else {
+                for (j = i; j < i + BATCH_SIZE; j++) {
+                    vikfree(pointers[j]);
+                }
+            }
+        }
+    }
+    gettimeofday(&tv1, NULL);
+    vikalloc_reset();
+
+    return (20.0 * num_ptrs) / elapsed(&tv0, &tv1);
+}
+
+void
+batch_compare(int num_ptrs)
+{
+    double single_rate = batch_workload(num_ptrs, FALSE);
+
+    fprintf(stdout, "batch of %d  single: %10.0lf/sec  batched: %10.0lf/sec\n"
+            , BATCH_SIZE, single_rate, batch_workload(num_ptrs, TRUE));
+}
+
+// The single calls of batch_workload(), untraced and traced into
+//   /dev/null, which shows what it costs to leave tracing on.
+void
+trace_compare(int num_ptrs)
+{
+    FILE *trace = fopen("/dev/null", "w");
+    double plain_rate = 0.0;
+    double traced_rate = 0.0;
+
+    if (trace == NULL) {
+        perror("cannot trace into /dev/null, not comparing");
+        return;
+    }
+    plain_rate = batch_workload(num_ptrs, FALSE);
+    vikalloc_set_trace(trace);
+    traced_rate = batch_workload(num_ptrs, FALSE);
+    vikalloc_set_trace(NULL);
+    fclose(trace);
+    fprintf(stdout, "trace  off: %10.0lf/sec  on: %10.0lf/sec\n", plain_rate, traced_rate);
+}
+
+#ifdef VIK_THREADS
+#define THREAD_PTRS 1000
+#define THREAD_OPS 1000000
+#define MAX_THREADS 32
+
+// Every thread keeps a window of live blocks and replaces one of them
+//   at a time.
+void *
+thread_workload(void *arg)
+{
+    void *ptrs[THREAD_PTRS] = {NULL};
+    int i = 0;
+    int j = 0;
+
+    for(i = 0; i < THREAD_OPS; i++) {
+        j = (i * 7) % THREAD_PTRS;
+        vikfree(ptrs[j]);
+        ptrs[j] = vikalloc(((i * 13) % 64 + 1) * 16);
+    }
+    for(j = 0; j < THREAD_PTRS; j++) {
+        vikfree(ptrs[j]);
+    }
+
+    return arg;
+}
+
+// With the arenas, the throughput should grow with the number of
+//   threads, up to the number of cores.
+void
+thread_compare(void)
+{
+    pthread_t threads[MAX_THREADS];
+    struct timeval tv0;
+    struct timeval tv1;
+    int num_threads = 0;
+    int i = 0;
+
+    for (num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+        gettimeofday(&tv0, NULL);
+        for (i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, thread_workload, NULL);
+        }
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        gettimeofday(&tv1, NULL);
+        fprintf(stdout, "threads: %2d  ops/sec: %.0lf\n", num_threads
+                , (2.0 * THREAD_OPS * num_threads) / elapsed(&tv0, &tv1));
+    }
+    vikalloc_reset();
 }
+#endif // VIK_THREADS
 
 void 
 coalesce1(int testno)